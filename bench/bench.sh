@@ -0,0 +1,144 @@
+#!/bin/sh
+# bench.sh - generates synthetic resource sets and measures elfrc on them
+#
+# Run via 'make bench'. The following environment variables are used:
+#
+#   BENCH_DIR    where to put the generated data (default: a new directory
+#                in ${TMPDIR:-/tmp}, removed afterwards unless BENCH_KEEP
+#                is set)
+#   BENCH_SCALE  multiplies the number and size of the generated files
+#                (default: 1)
+#   BENCH_JOBS   passed to elfrc as -j (default: 1)
+#   ELFRC_FLAGS  any further arguments for elfrc
+#
+# For each workload, elfrc is run twice: once only writing the header
+# (which is dominated by parsing the resource file and scanning the
+# inputs) and once writing the object file too. The difference of both
+# is the time spent on copying the payload. Finally the object file is
+# linked into a program with each of ld.bfd, ld.gold and ld.lld that can
+# be found.
+
+set -e
+
+TOP=`cd \`dirname "$0"\`/.. && pwd`
+ELFRC="$TOP/elfrc"
+MEASURE="$TOP/bench/measure"
+CC=${CC:-cc}
+SCALE=${BENCH_SCALE:-1}
+JOBS=${BENCH_JOBS:-1}
+
+if [ -n "$BENCH_DIR" ]; then
+    DIR=$BENCH_DIR
+    mkdir -p "$DIR"
+else
+    DIR=`mktemp -d "${TMPDIR:-/tmp}/elfrc-bench.XXXXXX"`
+    test -n "$BENCH_KEEP" || trap 'rm -rf "$DIR"' 0
+fi
+
+# gen_files <dir> <count> <maxsize> <kind> writes <count> files with
+# sizes between 1 and <maxsize> bytes to <dir> and appends the matching
+# lines to <dir>.rc; <kind> is 'text', 'binary' or 'mixed'.
+gen_files()
+{
+    mkdir -p "$1"
+    awk -v dir="$1" -v n="$2" -v max="$3" -v kind="$4" 'BEGIN {
+        srand(42)
+        pad = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ\n"
+        while ( length( pad ) < max ) pad = pad pad
+        for ( i = 0; i < n; ++i ) {
+            f = dir "/f" i
+            len = 1 + int( rand() * max )
+            printf "%s", substr( sprintf( "%d", i ) pad, 1, len ) > f
+            close( f )
+            type = kind == "mixed" ? ( i % 2 ? "text" : "binary" ) : kind
+            printf "%s\tr%d\t%s\n", type, i, f
+        }
+    }' >> "$1.rc"
+}
+
+# gen_tree <dir> <depth> <fanout> <files> builds a directory tree with
+# <files> small files in every leaf and a resource file with one 'dir'
+# line for it.
+gen_tree()
+{
+    awk -v dir="$1" -v depth="$2" -v fanout="$3" -v files="$4" '
+    function build( path, level,    i, f ) {
+        system( "mkdir -p \"" path "\"" )
+        if ( level == depth ) {
+            for ( i = 0; i < files; ++i ) {
+                f = path "/leaf" i ".dat"
+                printf "%s %d\n", path, i > f
+                close( f )
+            }
+            return
+        }
+        for ( i = 0; i < fanout; ++i )
+            build( path "/d" i, level + 1 )
+    }
+    BEGIN { build( dir, 0 ) }'
+    printf 'dir\ttree\t%s\n' "$1" > "$1.rc"
+}
+
+gen_huge()
+{
+    mkdir -p "$1"
+    : > "$1.rc"
+    dd if=/dev/urandom of="$1/huge0" bs=1048576 count=`expr 64 \* "$SCALE"` 2>/dev/null
+    for i in 1 2; do
+        cp "$1/huge0" "$1/huge$i"
+    done
+    for i in 0 1 2; do
+        printf 'binary\thuge%d\t%s/huge%d\n' $i "$1" $i >> "$1.rc"
+    done
+}
+
+echo "Generating workloads in $DIR"
+rm -f "$DIR"/*.rc
+gen_files "$DIR/tiny" `expr 20000 \* "$SCALE"` 64 binary
+gen_files "$DIR/mixed" `expr 2000 \* "$SCALE"` 65536 mixed
+gen_huge "$DIR/huge"
+gen_tree "$DIR/tree" 6 3 `expr 8 \* "$SCALE"`
+
+printf 'int main( void ) { return 0; }\n' > "$DIR/main.c"
+$CC -c -o "$DIR/main.o" "$DIR/main.c"
+
+LINKERS=
+for ld in bfd gold lld; do
+    if $CC -fuse-ld=$ld -o "$DIR/probe" "$DIR/main.o" >/dev/null 2>&1; then
+        LINKERS="$LINKERS $ld"
+    fi
+done
+
+# report <label> <seconds> <RSS> [<extra>] prints a line of the report.
+report()
+{
+    printf '  %-14s %8.3f s  %8d KiB peak RSS%s\n' "$1" $2 $3 "$4"
+}
+
+for w in tiny mixed huge tree; do
+    rc="$DIR/$w.rc"
+    rm -f "$DIR/$w.o" "$DIR/$w.h"
+
+    set -- `"$MEASURE" "$ELFRC" -j "$JOBS" $ELFRC_FLAGS -h "$DIR/$w.h" "$rc"`
+    scan=$1
+    scanrss=$2
+    set -- `"$MEASURE" "$ELFRC" -j "$JOBS" $ELFRC_FLAGS -o "$DIR/$w.o" -h "$DIR/$w.h" "$rc"`
+    total=$1
+    rss=$2
+
+    count=`grep -c '^extern const' "$DIR/$w.h"`
+    bytes=`wc -c < "$DIR/$w.o"`
+    echo
+    echo "$w: $count resources, $bytes bytes of object file"
+    report "scan" $scan $scanrss
+    report "scan + write" $total $rss \
+        "`awk -v t=$total -v n=$count -v b=$bytes 'BEGIN {
+            if ( t <= 0 ) t = 0.001
+            printf "  %.1f MB/s  %.0f resources/s", b / t / 1e6, n / t }'`"
+
+    for ld in $LINKERS; do
+        set -- `"$MEASURE" $CC -fuse-ld=$ld -o "$DIR/$w.out" "$DIR/main.o" "$DIR/$w.o" 2>/dev/null`
+        report "link ($ld)" $1 $2
+    done
+    rm -f "$DIR/$w.out"
+done
@@ -0,0 +1,65 @@
+/* measure.c - runs a command and reports its wall time and peak RSS
+ *
+ * Part of the elfrc benchmarks, see bench.sh. Usage:
+ *
+ *   measure <command> [<arguments>...]
+ *
+ * The command's output goes to /dev/null; on success, a line of the
+ * form '<seconds> <peak RSS in KiB>' is printed to standard output.
+ * The exit status is that of the command.
+ */
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+int main( int argc, char **argv )
+{
+    struct timeval start, end;
+    struct rusage usage;
+    pid_t pid;
+    int status, fd;
+
+    if ( argc < 2 ) {
+        fprintf( stderr, "usage: measure <command> [<arguments>...]\n" );
+        return 2;
+    }
+
+    gettimeofday( &start, NULL );
+    if ( ( pid = fork() ) == -1 ) {
+        fprintf( stderr, "Failed to fork: %s\n", strerror( errno ) );
+        return 2;
+    }
+    if ( pid == 0 ) {
+        if ( ( fd = open( "/dev/null", O_WRONLY ) ) != -1 ) {
+            dup2( fd, 1 );
+            close( fd );
+        }
+        execvp( argv[1], argv + 1 );
+        fprintf( stderr, "Failed to run %s: %s\n", argv[1], strerror( errno ) );
+        _exit( 127 );
+    }
+
+    while ( wait4( pid, &status, 0, &usage ) == -1 ) {
+        if ( errno != EINTR ) {
+            fprintf( stderr, "Failed to wait for %s: %s\n", argv[1], strerror( errno ) );
+            return 2;
+        }
+    }
+    gettimeofday( &end, NULL );
+
+    if ( !WIFEXITED( status ) || WEXITSTATUS( status ) != 0 )
+        return WIFEXITED( status ) ? WEXITSTATUS( status ) : 1;
+
+    /* ru_maxrss is in KiB on Linux and the BSDs. */
+    printf( "%.3f %ld\n",
+            ( end.tv_sec - start.tv_sec ) + ( end.tv_usec - start.tv_usec ) / 1e6,
+            (long)usage.ru_maxrss );
+    return 0;
+}
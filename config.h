@@ -0,0 +1,5 @@
+#ifndef __Linux__
+#  define __Linux__ 1
+#endif
+#define ELFRC_VERSION "0.7"
+#define HAVE_IO_URING 1
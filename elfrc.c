@@ -30,13 +30,30 @@
 
 #define ELFRC_COPYRIGHT "Copyright (C) 2006 Frerich Raabe <raabe@kde.org>"
 
+/* Needed for copy_file_range() on Linux; harmless elsewhere. */
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <ctype.h>
+#include <dirent.h>
 #include <elf.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -45,50 +62,214 @@
 
 #include "config.h"
 
-/* Unfortunately Linux only makes the generic ElfW(type) macro
- * public, all the other generics like ELF_CLASS or ELF_DATA
- * are private.
- */
+#ifdef HAVE_ZSTD
+#  include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#  include <lz4.h>
+#endif
+
 #ifdef __Linux__
-#  include <link.h>
-#  ifndef ELF_CLASS
-#    if __ELF_NATIVE_CLASS == 32
-#      define ELF_CLASS ELFCLASS32
-#    elif __ELF_NATIVE_CLASS == 64
-#      define ELF_CLASS ELFCLASS64
-#    endif
-#  endif
-#  ifndef ELF_DATA
-#    if __BYTE_ORDER == __LITTLE_ENDIAN
-#      define ELF_DATA ELFDATA2LSB
-#    elif __BYTE_ORDER == __BIG_ENDIAN
-#      define ELF_DATA ELFDATA2MSB
-#    endif
-#  endif
-#  ifndef ELF_ST_INFO
-#    define ELF_ST_INFO( type, bind ) (((type) << 4) + ((bind) & 0xf))
-#  endif
+#  include <sys/inotify.h>
+#  include <sys/sendfile.h>
+#  include <sys/signalfd.h>
+#endif
+
+/* The target used when -m isn't given, i.e. the one elfrc was built
+ * for. Elsewhere, -m is mandatory. */
+#if defined(__x86_64__) && defined(__ILP32__)
+#  define NATIVE_TARGET "x32"
+#elif defined(__x86_64__)
+#  define NATIVE_TARGET "x86_64"
+#elif defined(__i386__)
+#  define NATIVE_TARGET "i386"
+#elif defined(__aarch64__) && defined(__AARCH64EB__)
+#  define NATIVE_TARGET "aarch64_be"
+#elif defined(__aarch64__)
+#  define NATIVE_TARGET "aarch64"
+#elif defined(__arm__) && defined(__ARMEB__)
+#  define NATIVE_TARGET "armeb"
+#elif defined(__arm__)
+#  define NATIVE_TARGET "arm"
+#elif defined(__riscv) && __riscv_xlen == 64
+#  define NATIVE_TARGET "riscv64"
+#elif defined(__riscv) && __riscv_xlen == 32
+#  define NATIVE_TARGET "riscv32"
+#elif defined(__powerpc64__) && defined(__LITTLE_ENDIAN__)
+#  define NATIVE_TARGET "ppc64le"
+#elif defined(__powerpc64__)
+#  define NATIVE_TARGET "ppc64"
+#elif defined(__powerpc__)
+#  define NATIVE_TARGET "ppc"
+#elif defined(__s390x__)
+#  define NATIVE_TARGET "s390x"
+#elif defined(__loongarch64)
+#  define NATIVE_TARGET "loongarch64"
+#endif
+
+#ifdef __FreeBSD__
+#  define NATIVE_OSABI ELFOSABI_FREEBSD
 #else
-#  define ElfW(type) Elf_##type
+#  define NATIVE_OSABI ELFOSABI_NONE
+#endif
+
+/* io_uring is used through the raw system calls, so only the kernel
+ * headers are needed; the Makefile defines HAVE_IO_URING if they know
+ * all the operations used. Whether the running kernel supports them is
+ * checked at runtime. */
+#if defined(__Linux__) && defined(HAVE_IO_URING)
+#  include <linux/io_uring.h>
+#  include <sys/syscall.h>
 #endif
 
 struct Resource {
-    enum { TEXT = 0, BINARY = 1 } type;
+    enum { TEXT = 0, BINARY = 1, ZSTD = 2, LZ4 = 3, LOOKUPTABLE = 4,
+           DIRECTORY = 5 /* Only in resource files */, LINEINDEX = 6,
+           CONTENTHASH = 7, ZERO = 8, ZERORO = 9 } type;
     char *symbol;
     unsigned int symbolSize;
     char *filename;
-    unsigned int size;
+    uint64_t size;
+    uint64_t rawSize;           /* Uncompressed size of compressed resources */
+    dev_t device;               /* Device holding 'source', 0 if not known */
+    unsigned int align;         /* Alignment of the payload, 0 for default */
+    char *data;                 /* Payload kept in memory, or 0 */
+    char *source;               /* File the payload is read from; 'filename'
+                                   unless a stream was spilled to disk */
+    int generated;              /* Created by elfrc rather than read from a file */
     enum { FALSE = 0, TRUE = 1 } ignore;
-    unsigned int payloadOffset;
-    unsigned int strtabOffset;
+    uint64_t payloadOffset;
+    uint64_t strtabOffset;
+    struct Resource *alias;     /* Resource with identical payload, or 0 */
+    double copySeconds;         /* Time spent copying the payload, for --stats */
+    unsigned int shard;         /* Object file the resource goes to */
+    unsigned int section;       /* Index of the section holding the payload */
     struct Resource *next;
 } *resources = 0;
 
 int verbosity = 0;
+int jobs = 1;
+int ioUring = 0;
+int deduplicate = 0;
+unsigned long long maxObjectSize = 0;
+int sectionPerResource = 0;
+int largeData = 0;
+const char *lookupTable = 0;
+enum { KeySymbol, KeyFilename } lookupKey = KeySymbol;
+const char *statsOutput = 0;
+const char *batchManifest = 0;
+int sharedObject = 0;
+int lineIndex = 0;
+int contentHash = 0;
+const char *packOutput = 0;
 
 #define SECTIONHEADERCOUNT 9
-#define TOTALHEADERSIZE ( sizeof( ElfW( Ehdr ) ) + \
-                          sizeof( ElfW( Shdr ) ) * ( SECTIONHEADERCOUNT ) )
+#define TOTALHEADERSIZE ( sizeof( Elf64_Ehdr ) + \
+                          sizeof( Elf64_Shdr ) * ( SECTIONHEADERCOUNT ) )
+#define BSSSECTION 3
+#define RODATASECTION 4
+#define HUGEPAGESIZE ( 2 << 20 )
+#define LRODATANAME 61
+
+#ifndef SHF_X86_64_LARGE
+#  define SHF_X86_64_LARGE 0x10000000
+#endif
+
+/* Number of sections, including the .rodata.<symbol> sections
+ * created by --section-per-resource. */
+static unsigned int sectionCount = SECTIONHEADERCOUNT;
+
+/* Size of all payloads, including the padding between them. */
+static uint64_t payloadSize;
+
+/* Size of the 'zero' and 'zero-ro' resources in .bss. */
+static uint64_t bssSize;
+
+/* Collected for --stats: the time and the number of read and write
+ * system calls spent in each phase, in the order they first ran.
+ * Phases which run several times (e.g. once per object file) add up.
+ */
+struct Phase {
+    const char *name;
+    double seconds;
+    long long syscalls;
+};
+
+struct PhaseMark {
+    double start;
+    long long syscalls;
+};
+
+static struct Phase phases[ 16 ];
+static unsigned int phaseCount;
+static uint64_t paddingBytes;
+static int ioStatsFd = -1;
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns the number of read and write system calls made by this
+ * process so far, or -1 if the system doesn't tell (only Linux does,
+ * in /proc/self/io). The reads of /proc/self/io itself don't count. */
+static long long ioSyscalls()
+{
+    static long long ownReads = 0;
+    char buffer[ 256 ], *it;
+    long long count = -ownReads++;
+    ssize_t len;
+
+    if ( ioStatsFd == -1 || ( len = pread( ioStatsFd, buffer, sizeof( buffer ) - 1, 0 ) ) <= 0 )
+        return -1;
+    buffer[ len ] = '\0';
+
+    if ( ( it = strstr( buffer, "syscr: " ) ) != NULL )
+        count += strtoll( it + 7, NULL, 10 );
+    if ( ( it = strstr( buffer, "syscw: " ) ) != NULL )
+        count += strtoll( it + 7, NULL, 10 );
+    return count;
+}
+
+static void markPhase( struct PhaseMark *mark )
+{
+    if ( !statsOutput )
+        return;
+    mark->start = now();
+    mark->syscalls = ioSyscalls();
+}
+
+static void endPhase( const struct PhaseMark *mark, const char *name )
+{
+    struct Phase *phase;
+    long long syscalls;
+    unsigned int i;
+
+    if ( !statsOutput )
+        return;
+
+    for ( i = 0; i < phaseCount && strcmp( phases[ i ].name, name ) != 0; ++i )
+        ;
+    if ( i == sizeof( phases ) / sizeof( phases[0] ) )
+        return;
+    phase = &phases[ i ];
+    if ( i == phaseCount ) {
+        phase->name = name;
+        phase->seconds = 0;
+        phase->syscalls = 0;
+        ++phaseCount;
+    }
+
+    phase->seconds += now() - mark->start;
+    syscalls = ioSyscalls();
+    if ( syscalls == -1 || mark->syscalls == -1 || phase->syscalls == -1 )
+        phase->syscalls = -1;
+    else
+        phase->syscalls += syscalls - mark->syscalls;
+}
 
 static const char commentData[] = "Created by elfrc "
                                   ELFRC_VERSION
@@ -103,86 +284,91 @@ static const char shstrtabData[] =
     ".comment\0"
     ".shstrtab\0"
     ".symtab\0"
-    ".strtab";
+    ".strtab\0"
+    ".lrodata";
 
-static const ElfW(Sym) symtabData[] = {
+/* The local symbols every object starts with; their number ends up
+ * in the sh_info field of the symbol table header. */
+static const Elf64_Sym symtabData[] = {
     /* First symbol is the 'undefined' symbol */
     {
-        0,                           /* Name (index into string table) */
-        0,                        /* Symbol value */
-        0,                        /* Size of associated object */
-        ELF_ST_INFO( STB_LOCAL, STT_NOTYPE ),    /* Type and binding */
-        STV_DEFAULT,                /* Visibility */
-        STN_UNDEF                    /* Section index of symbol */
+        .st_name = 0,                           /* Name (index into string table) */
+        .st_value = 0,                        /* Symbol value */
+        .st_size = 0,                        /* Size of associated object */
+        .st_info = ELF64_ST_INFO( STB_LOCAL, STT_NOTYPE ),    /* Type and binding */
+        .st_other = STV_DEFAULT,                /* Visibility */
+        .st_shndx = STN_UNDEF                    /* Section index of symbol */
     },
 
     /* Symbol for the original file */
     {
-        0,                        /* Name (index into string table) */
-        0,                        /* Symbol value */
-        0,                        /* Size of associated object */
-        ELF_ST_INFO( STB_LOCAL, STT_FILE ),        /* Type and binding */
-        STV_DEFAULT,                /* Visibility */
-        SHN_ABS                    /* Section index of symbol */
+        .st_name = 0,                        /* Name (index into string table) */
+        .st_value = 0,                        /* Symbol value */
+        .st_size = 0,                        /* Size of associated object */
+        .st_info = ELF64_ST_INFO( STB_LOCAL, STT_FILE ),        /* Type and binding */
+        .st_other = STV_DEFAULT,                /* Visibility */
+        .st_shndx = SHN_ABS                    /* Section index of symbol */
     },
 
     /* Symbol for the .text section */
     {
-        0,                        /* Name (index into string table) */
-        0,                        /* Symbol value */
-        0,                        /* Size of associated object */
-        ELF_ST_INFO( STB_LOCAL, STT_SECTION ),    /* Type and binding */
-        STV_DEFAULT,                /* Visibility */
-        1                        /* Section index of symbol */
+        .st_name = 0,                        /* Name (index into string table) */
+        .st_value = 0,                        /* Symbol value */
+        .st_size = 0,                        /* Size of associated object */
+        .st_info = ELF64_ST_INFO( STB_LOCAL, STT_SECTION ),    /* Type and binding */
+        .st_other = STV_DEFAULT,                /* Visibility */
+        .st_shndx = 1                        /* Section index of symbol */
     },
 
     /* Symbol for the .data section */
     {
-        0,                        /* Name (index into string table) */
-        0,                        /* Symbol value */
-        0,                        /* Size of associated object */
-        ELF_ST_INFO( STB_LOCAL, STT_SECTION ),    /* Type and binding */
-        STV_DEFAULT,                /* Visibility */
-        2                        /* Section index of symbol */
+        .st_name = 0,                        /* Name (index into string table) */
+        .st_value = 0,                        /* Symbol value */
+        .st_size = 0,                        /* Size of associated object */
+        .st_info = ELF64_ST_INFO( STB_LOCAL, STT_SECTION ),    /* Type and binding */
+        .st_other = STV_DEFAULT,                /* Visibility */
+        .st_shndx = 2                        /* Section index of symbol */
     },
 
     /* Symbol for the .bss section */
     {
-        0,                        /* Name (index into string table) */
-        0,                        /* Symbol value */
-        0,                        /* Size of associated object */
-        ELF_ST_INFO( STB_LOCAL, STT_SECTION ),    /* Type and binding */
-        STV_DEFAULT,                /* Visibility */
-        3                        /* Section index of symbol */
+        .st_name = 0,                        /* Name (index into string table) */
+        .st_value = 0,                        /* Symbol value */
+        .st_size = 0,                        /* Size of associated object */
+        .st_info = ELF64_ST_INFO( STB_LOCAL, STT_SECTION ),    /* Type and binding */
+        .st_other = STV_DEFAULT,                /* Visibility */
+        .st_shndx = 3                        /* Section index of symbol */
     },
 
     /* Symbol for the .rodata section */
     {
-        0,                        /* Name (index into string table) */
-        0,                        /* Symbol value */
-        0,                        /* Size of associated object */
-        ELF_ST_INFO( STB_LOCAL, STT_SECTION ),    /* Type and binding */
-        STV_DEFAULT,                /* Visibility */
-        4                        /* Section index of symbol */
+        .st_name = 0,                        /* Name (index into string table) */
+        .st_value = 0,                        /* Symbol value */
+        .st_size = 0,                        /* Size of associated object */
+        .st_info = ELF64_ST_INFO( STB_LOCAL, STT_SECTION ),    /* Type and binding */
+        .st_other = STV_DEFAULT,                /* Visibility */
+        .st_shndx = 4                        /* Section index of symbol */
     },
 
     /* Symbol for the .comment section */
     {
-        0,                        /* Name (index into string table) */
-        0,                        /* Symbol value */
-        0,                        /* Size of associated object */
-        ELF_ST_INFO( STB_LOCAL, STT_SECTION ),    /* Type and binding */
-        STV_DEFAULT,                /* Visibility */
-        5                        /* Section index of symbol */
+        .st_name = 0,                        /* Name (index into string table) */
+        .st_value = 0,                        /* Symbol value */
+        .st_size = 0,                        /* Size of associated object */
+        .st_info = ELF64_ST_INFO( STB_LOCAL, STT_SECTION ),    /* Type and binding */
+        .st_other = STV_DEFAULT,                /* Visibility */
+        .st_shndx = 5                        /* Section index of symbol */
     }
 
     /* This array is extended with symbols for each resource. */
 };
 
-static ElfW(Ehdr) hdr = {
+#define LOCALSYMBOLCOUNT ( sizeof( symtabData ) / sizeof( symtabData[0] ) )
+
+static Elf64_Ehdr hdr = {
     { ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3,
-      ELF_CLASS,
-      ELF_DATA,
+      0,                  /* PATCHED: Class */
+      0,                  /* PATCHED: Data encoding */
       EV_CURRENT,
       0,                  /* PATCHED: OS ABI */
       0,
@@ -193,17 +379,17 @@ static ElfW(Ehdr) hdr = {
     1,                    /* ELF format version */
     0,                    /* Entry point */
     0,                    /* Program header file offset */
-    sizeof( hdr ),        /* Section header file offset */
+    0,                    /* PATCHED: Section header file offset */
     0,                    /* PATCHED: Architecture-specific flags */
-    sizeof( hdr ),        /* Size of this ELF header */
+    0,                    /* PATCHED: Size of this ELF header */
     0,                    /* Size of program header entry */
     0,                    /* Number of program header entries */
-    sizeof( ElfW(Shdr) ), /* Size of section header entry */
+    0,                    /* PATCHED: Size of section header entry */
     SECTIONHEADERCOUNT,   /* Number of section header entries */
     6                     /* Section name strings section */
 };
 
-static const ElfW(Shdr) nullHeader = {
+static const Elf64_Shdr nullHeader = {
     0,                /* Index into section header string table */
     SHT_NULL,            /* Section type */
     0,                /* Section flags */
@@ -216,7 +402,7 @@ static const ElfW(Shdr) nullHeader = {
     0                /* Size of each entry in section */
 };
 
-static const ElfW(Shdr) textHeader = {
+static const Elf64_Shdr textHeader = {
     1,                /* Index into section header string table */
     SHT_PROGBITS,            /* Section type */
     SHF_ALLOC | SHF_EXECINSTR,    /* Section flags */
@@ -229,7 +415,7 @@ static const ElfW(Shdr) textHeader = {
     0                /* Size of each entry in section */
 };
 
-static const ElfW(Shdr) dataHeader = {
+static const Elf64_Shdr dataHeader = {
     7,                /* Index into section header string table */
     SHT_PROGBITS,            /* Section type */
     SHF_ALLOC | SHF_WRITE,        /* Section flags */
@@ -242,20 +428,20 @@ static const ElfW(Shdr) dataHeader = {
     0                /* Size of each entry in section */
 };
 
-static const ElfW(Shdr) bssHeader = {
+static Elf64_Shdr bssHeader = {
     13,                /* Index into section header string table */
     SHT_NOBITS,            /* Section type */
     SHF_ALLOC | SHF_WRITE,        /* Section flags */
     0,                /* Address in memory image */
     0,                /* Offset in file */
-    0,                /* Size in bytes */
+    0,                /* PATCHED: Size in bytes */
     0,                /* Index of a related section */
     0,                /* Depends on section type */
-    4,                /* Alignment in bytes */
+    4,                /* PATCHED: Alignment in bytes */
     0                /* Size of each entry in section */
 };
 
-static ElfW(Shdr) rodataHeader = {
+static Elf64_Shdr rodataHeader = {
     18,                /* Index into section header string table */
     SHT_PROGBITS,            /* Section type */
     SHF_ALLOC,            /* Section flags */
@@ -271,7 +457,7 @@ static ElfW(Shdr) rodataHeader = {
     0                /* Size of each entry in section */
 };
 
-static ElfW(Shdr) commentHeader = {
+static Elf64_Shdr commentHeader = {
     26,                /* Index into section header string table */
     SHT_PROGBITS,            /* Section type */
     0,                /* Section flags */
@@ -284,7 +470,7 @@ static ElfW(Shdr) commentHeader = {
     0                /* Size of each entry in section */
 };
 
-static ElfW(Shdr) shstrtabHeader = {
+static Elf64_Shdr shstrtabHeader = {
     35,                /* Index into section header string table */
     SHT_STRTAB,            /* Section type */
     0,                /* Section flags */
@@ -298,7 +484,7 @@ static ElfW(Shdr) shstrtabHeader = {
     0                /* Size of each entry in section */
 };
 
-static ElfW(Shdr) symtabHeader = {
+static Elf64_Shdr symtabHeader = {
     45,                /* Index into section header string table */
     SHT_SYMTAB,            /* Section type */
     0,                /* Section flags */
@@ -310,10 +496,10 @@ static ElfW(Shdr) symtabHeader = {
     8,                /* Index of a related section */
     7,                /* Depends on section type */
     4,                /* Alignment in bytes */
-    sizeof( symtabData[ 0 ] )    /* Size of each entry in section */
+    0                 /* PATCHED: Size of each entry in section */
 };
 
-static ElfW(Shdr) strtabHeader = {
+static Elf64_Shdr strtabHeader = {
     53,                /* Index into section header string table */
     SHT_STRTAB,            /* Section type */
     0,                /* Section flags */
@@ -329,7 +515,203 @@ static ElfW(Shdr) strtabHeader = {
     0                /* Size of each entry in section */
 };
 
-static int copyFileToFD( const char *src, int dst )
+/* A streaming implementation of xxHash64, used to find identical
+ * payloads. See https://github.com/Cyan4973/xxHash for the spec.
+ */
+#define XXH_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3 0x165667B19E3779F9ULL
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5 0x27D4EB2F165667C5ULL
+
+struct Hash {
+    uint64_t v[ 4 ];
+    uint64_t total;
+    unsigned char buffer[ 32 ];
+    size_t buffered;
+};
+
+static uint64_t rotl64( uint64_t x, int r )
+{
+    return ( x << r ) | ( x >> ( 64 - r ) );
+}
+
+static uint64_t read64( const unsigned char *p )
+{
+    uint64_t v;
+    memcpy( &v, p, sizeof( v ) );
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64( v );
+#endif
+    return v;
+}
+
+static uint32_t read32( const unsigned char *p )
+{
+    uint32_t v;
+    memcpy( &v, p, sizeof( v ) );
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32( v );
+#endif
+    return v;
+}
+
+static uint64_t hashRound( uint64_t acc, uint64_t input )
+{
+    acc += input * XXH_PRIME2;
+    acc = rotl64( acc, 31 );
+    return acc * XXH_PRIME1;
+}
+
+static uint64_t hashMerge( uint64_t acc, uint64_t v )
+{
+    acc ^= hashRound( 0, v );
+    return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+static void hashInit( struct Hash *h, uint64_t seed )
+{
+    h->v[ 0 ] = seed + XXH_PRIME1 + XXH_PRIME2;
+    h->v[ 1 ] = seed + XXH_PRIME2;
+    h->v[ 2 ] = seed;
+    h->v[ 3 ] = seed - XXH_PRIME1;
+    h->total = 0;
+    h->buffered = 0;
+}
+
+static void hashUpdate( struct Hash *h, const void *data, size_t len )
+{
+    const unsigned char *p = (const unsigned char *)data;
+    const unsigned char *end = p + len;
+    size_t n;
+
+    h->total += len;
+
+    if ( h->buffered > 0 ) {
+        n = sizeof( h->buffer ) - h->buffered;
+        if ( n > len )
+            n = len;
+        memcpy( h->buffer + h->buffered, p, n );
+        h->buffered += n;
+        p += n;
+        if ( h->buffered < sizeof( h->buffer ) )
+            return;
+        h->v[ 0 ] = hashRound( h->v[ 0 ], read64( h->buffer ) );
+        h->v[ 1 ] = hashRound( h->v[ 1 ], read64( h->buffer + 8 ) );
+        h->v[ 2 ] = hashRound( h->v[ 2 ], read64( h->buffer + 16 ) );
+        h->v[ 3 ] = hashRound( h->v[ 3 ], read64( h->buffer + 24 ) );
+        h->buffered = 0;
+    }
+
+    /* The four lanes are independent, which lets the CPU (and the
+     * compiler) work on them in parallel. */
+    for ( ; end - p >= 32; p += 32 ) {
+        h->v[ 0 ] = hashRound( h->v[ 0 ], read64( p ) );
+        h->v[ 1 ] = hashRound( h->v[ 1 ], read64( p + 8 ) );
+        h->v[ 2 ] = hashRound( h->v[ 2 ], read64( p + 16 ) );
+        h->v[ 3 ] = hashRound( h->v[ 3 ], read64( p + 24 ) );
+    }
+
+    memcpy( h->buffer, p, end - p );
+    h->buffered = end - p;
+}
+
+static uint64_t hashFinal( const struct Hash *h )
+{
+    const unsigned char *p = h->buffer;
+    const unsigned char *end = p + h->buffered;
+    uint64_t acc;
+
+    if ( h->total >= 32 ) {
+        acc = rotl64( h->v[ 0 ], 1 ) + rotl64( h->v[ 1 ], 7 ) +
+              rotl64( h->v[ 2 ], 12 ) + rotl64( h->v[ 3 ], 18 );
+        acc = hashMerge( acc, h->v[ 0 ] );
+        acc = hashMerge( acc, h->v[ 1 ] );
+        acc = hashMerge( acc, h->v[ 2 ] );
+        acc = hashMerge( acc, h->v[ 3 ] );
+    } else {
+        acc = h->v[ 2 ] + XXH_PRIME5;
+    }
+    acc += h->total;
+
+    for ( ; end - p >= 8; p += 8 )
+        acc = rotl64( acc ^ hashRound( 0, read64( p ) ), 27 ) * XXH_PRIME1 + XXH_PRIME4;
+    if ( end - p >= 4 ) {
+        acc = rotl64( acc ^ ( read32( p ) * XXH_PRIME1 ), 23 ) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+    }
+    for ( ; p < end; ++p )
+        acc = rotl64( acc ^ ( *p * XXH_PRIME5 ), 11 ) * XXH_PRIME1;
+
+    acc ^= acc >> 33;
+    acc *= XXH_PRIME2;
+    acc ^= acc >> 29;
+    acc *= XXH_PRIME3;
+    acc ^= acc >> 32;
+    return acc;
+}
+
+#ifdef __Linux__
+/* Lets the kernel move the data from 'src' to 'dst' without bouncing
+ * it through user space; copy_file_range() may even share the blocks
+ * on reflink capable file systems. If 'offset' is given, the data is
+ * written at that position of 'dst' (and 'offset' is advanced), else
+ * at the current file offset. Returns 0 once 'src' hit EOF, or -1 if
+ * the kernel can't copy between these descriptors, in which case the
+ * caller should fall back to read() and write(). Any data copied so
+ * far is accounted for in the offsets, so the fallback picks up where
+ * this left off.
+ */
+static int kernelCopy( int src, int dst, off_t *offset )
+{
+    ssize_t ncopied;
+
+    while ( ( ncopied = copy_file_range( src, NULL, dst, offset, 1 << 30, 0 ) ) > 0 )
+        ;
+    if ( ncopied == 0 )
+        return 0;
+
+    /* sendfile() can only write at the current offset. */
+    if ( offset )
+        return -1;
+
+    while ( ( ncopied = sendfile( dst, src, NULL, 1 << 30 ) ) > 0 )
+        ;
+    if ( ncopied == 0 )
+        return 0;
+
+    return -1;
+}
+#endif
+
+/* Writes 'len' bytes of 'buffer' either at the current file offset
+ * of 'dst' or, if 'offset' is given, at '*offset' (advancing it).
+ */
+static int writeBuffer( int dst, const char *buffer, size_t len, off_t *offset )
+{
+    ssize_t nwritten;
+    size_t off;
+
+    for ( off = 0; off < len; off += nwritten ) {
+        if ( offset )
+            nwritten = pwrite( dst, buffer + off, len - off, *offset + off );
+        else
+            nwritten = write( dst, buffer + off, len - off );
+        if ( nwritten == -1 )
+            return -1;
+    }
+    if ( offset )
+        *offset += len;
+
+    return 0;
+}
+
+/* Appends the contents of 'src' to 'dst', or writes them at '*offset'
+ * (advancing it) if 'offset' is given. The latter doesn't touch the
+ * file offset of 'dst', so several threads can copy into the same
+ * file at once.
+ */
+static int copyFileToFD( const char *src, int dst, off_t *offset )
 {
     int fd;
     char buffer[ 8192 ];
@@ -343,556 +725,5327 @@ static int copyFileToFD( const char *src, int dst )
         return -1;
     }
 
-    do {
-        if ( ( nread = read( fd, buffer,sizeof( buffer ) ) ) == -1 ) {
+#ifdef __Linux__
+    if ( kernelCopy( fd, dst, offset ) == 0 )
+        return close( fd );
+#endif
+
+    for ( ;; ) {
+        if ( ( nread = read( fd, buffer, sizeof( buffer ) ) ) == -1 ) {
             fprintf( stderr, "Failed to read from %s: %s\n", src, strerror( errno ) );
             close( fd );
             return -1;
         }
+        if ( nread == 0 )
+            break;
 
-        if ( write( dst, buffer, nread ) == -1 ) {
+        if ( writeBuffer( dst, buffer, nread, offset ) == -1 ) {
+            fprintf( stderr, "Failed to write %s to object file: %s\n", src, strerror( errno ) );
             close( fd );
             return -1;
         }
-    } while ( nread == sizeof( buffer ) );
+    }
 
     return close( fd );
 }
 
-static unsigned int padding( unsigned int size )
+/* Like writev(), but keeps going on short writes and splits the
+ * vector into chunks of at most IOV_MAX entries. Note that the iovec
+ * array is modified in the process.
+ */
+static int writeVector( int fd, struct iovec *iov, int iovcnt )
 {
-    if ( size == rodataHeader.sh_addralign )
-        return 0;
-    return ( ( rodataHeader.sh_addralign - 1 ) & ( ~size ) ) + 1;
+    ssize_t nwritten;
+    int n;
+
+    while ( iovcnt > 0 ) {
+        n = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+        if ( ( nwritten = writev( fd, iov, n ) ) == -1 ) {
+            if ( errno == EINTR )
+                continue;
+            return -1;
+        }
+
+        /* Skip over whatever has been written completely. */
+        while ( iovcnt > 0 && (size_t)nwritten >= iov->iov_len ) {
+            nwritten -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if ( iovcnt > 0 ) {
+            iov->iov_base = (char *)iov->iov_base + nwritten;
+            iov->iov_len -= nwritten;
+        }
+    }
+
+    return 0;
+}
+
+/* The machines elfrc can create objects for. Everything is kept in
+ * the ELF64 structures internally and only converted to the class and
+ * byte order of the target when written out. */
+struct Target {
+    const char *name;
+    unsigned char elfClass;
+    unsigned char elfData;
+    Elf64_Half machine;
+    Elf64_Word flags;
+    Elf64_Xword pageSize;       /* Largest page size, for --shared */
+};
+
+static const struct Target targets[] = {
+    { "x86_64", ELFCLASS64, ELFDATA2LSB, EM_X86_64, 0, 0x1000 },
+    { "x32", ELFCLASS32, ELFDATA2LSB, EM_X86_64, 0, 0x1000 },
+    { "i386", ELFCLASS32, ELFDATA2LSB, EM_386, 0, 0x1000 },
+    { "aarch64", ELFCLASS64, ELFDATA2LSB, EM_AARCH64, 0, 0x10000 },
+    { "aarch64_be", ELFCLASS64, ELFDATA2MSB, EM_AARCH64, 0, 0x10000 },
+    { "arm", ELFCLASS32, ELFDATA2LSB, EM_ARM, 0x05000000 /* EABI version 5 */, 0x10000 },
+    { "armeb", ELFCLASS32, ELFDATA2MSB, EM_ARM, 0x05000000, 0x10000 },
+    { "riscv64", ELFCLASS64, ELFDATA2LSB, 243 /* EM_RISCV */, 0x0004 /* Double-float ABI */, 0x1000 },
+    { "riscv32", ELFCLASS32, ELFDATA2LSB, 243, 0x0004, 0x1000 },
+    { "ppc", ELFCLASS32, ELFDATA2MSB, EM_PPC, 0, 0x10000 },
+    { "ppc64", ELFCLASS64, ELFDATA2MSB, EM_PPC64, 1 /* ELFv1 ABI */, 0x10000 },
+    { "ppc64le", ELFCLASS64, ELFDATA2LSB, EM_PPC64, 2 /* ELFv2 ABI */, 0x10000 },
+    { "s390x", ELFCLASS64, ELFDATA2MSB, EM_S390, 0, 0x1000 },
+    { "loongarch64", ELFCLASS64, ELFDATA2LSB, 258 /* EM_LOONGARCH */, 0x43 /* LP64D, object v1 */, 0x10000 }
+};
+
+static const struct Target *target = 0;
+
+static const struct Target *findTarget( const char *name )
+{
+    unsigned int i;
+
+    for ( i = 0; i < sizeof( targets ) / sizeof( targets[0] ); ++i )
+        if ( strcmp( name, targets[ i ].name ) == 0 )
+            return &targets[ i ];
+    return 0;
+}
+
+/* Sizes of the structures (and of addresses) in the target's class. */
+static size_t wordSize()
+{
+    return target->elfClass == ELFCLASS64 ? 8 : 4;
+}
+
+static size_t ehdrSize()
+{
+    return target->elfClass == ELFCLASS64 ? sizeof( Elf64_Ehdr ) : sizeof( Elf32_Ehdr );
+}
+
+static size_t shdrSize()
+{
+    return target->elfClass == ELFCLASS64 ? sizeof( Elf64_Shdr ) : sizeof( Elf32_Shdr );
+}
+
+static size_t symSize()
+{
+    return target->elfClass == ELFCLASS64 ? sizeof( Elf64_Sym ) : sizeof( Elf32_Sym );
+}
+
+static size_t phdrSize()
+{
+    return target->elfClass == ELFCLASS64 ? sizeof( Elf64_Phdr ) : sizeof( Elf32_Phdr );
+}
+
+/* Fills in the target dependent fields of the static headers. */
+static void selectTarget( const struct Target *t, unsigned char osabi )
+{
+    target = t;
+    hdr.e_ident[ EI_CLASS ] = t->elfClass;
+    hdr.e_ident[ EI_DATA ] = t->elfData;
+    hdr.e_ident[ EI_OSABI ] = osabi;
+    hdr.e_machine = t->machine;
+    hdr.e_flags = t->flags;
+    hdr.e_ehsize = ehdrSize();
+    hdr.e_shentsize = shdrSize();
+    hdr.e_shoff = ehdrSize();
+    symtabHeader.sh_entsize = symSize();
+}
+
+/* Store 'v' at 'p' in the byte order of the target and return the
+ * position right after it. */
+static unsigned char *put16( unsigned char *p, uint16_t v )
+{
+    if ( target->elfData == ELFDATA2LSB ) {
+        p[0] = v;
+        p[1] = v >> 8;
+    } else {
+        p[0] = v >> 8;
+        p[1] = v;
+    }
+    return p + 2;
+}
+
+static unsigned char *put32( unsigned char *p, uint32_t v )
+{
+    if ( target->elfData == ELFDATA2LSB ) {
+        put16( p, v );
+        put16( p + 2, v >> 16 );
+    } else {
+        put16( p, v >> 16 );
+        put16( p + 2, v );
+    }
+    return p + 4;
+}
+
+static unsigned char *put64( unsigned char *p, uint64_t v )
+{
+    if ( target->elfData == ELFDATA2LSB ) {
+        put32( p, v );
+        put32( p + 4, v >> 32 );
+    } else {
+        put32( p, v >> 32 );
+        put32( p + 4, v );
+    }
+    return p + 8;
+}
+
+/* Addresses, offsets and the like are 32 or 64 bits wide. */
+static unsigned char *putWord( unsigned char *p, uint64_t v )
+{
+    return target->elfClass == ELFCLASS64 ? put64( p, v ) : put32( p, v );
 }
 
-static int writeSymbols( int fd )
+/* The field order is the same in both classes, except for symbols
+ * and program headers. */
+static unsigned char *encodeEhdr( unsigned char *p, const Elf64_Ehdr *h )
+{
+    memcpy( p, h->e_ident, EI_NIDENT );
+    p += EI_NIDENT;
+    p = put16( p, h->e_type );
+    p = put16( p, h->e_machine );
+    p = put32( p, h->e_version );
+    p = putWord( p, h->e_entry );
+    p = putWord( p, h->e_phoff );
+    p = putWord( p, h->e_shoff );
+    p = put32( p, h->e_flags );
+    p = put16( p, h->e_ehsize );
+    p = put16( p, h->e_phentsize );
+    p = put16( p, h->e_phnum );
+    p = put16( p, h->e_shentsize );
+    p = put16( p, h->e_shnum );
+    return put16( p, h->e_shstrndx );
+}
+
+static unsigned char *encodeShdr( unsigned char *p, const Elf64_Shdr *h )
+{
+    p = put32( p, h->sh_name );
+    p = put32( p, h->sh_type );
+    p = putWord( p, h->sh_flags );
+    p = putWord( p, h->sh_addr );
+    p = putWord( p, h->sh_offset );
+    p = putWord( p, h->sh_size );
+    p = put32( p, h->sh_link );
+    p = put32( p, h->sh_info );
+    p = putWord( p, h->sh_addralign );
+    return putWord( p, h->sh_entsize );
+}
+
+static unsigned char *encodePhdr( unsigned char *p, const Elf64_Phdr *h )
+{
+    p = put32( p, h->p_type );
+    if ( target->elfClass == ELFCLASS64 )
+        p = put32( p, h->p_flags );
+    p = putWord( p, h->p_offset );
+    p = putWord( p, h->p_vaddr );
+    p = putWord( p, h->p_paddr );
+    p = putWord( p, h->p_filesz );
+    p = putWord( p, h->p_memsz );
+    if ( target->elfClass == ELFCLASS32 )
+        p = put32( p, h->p_flags );
+    return putWord( p, h->p_align );
+}
+
+static unsigned char *encodeSym( unsigned char *p, const Elf64_Sym *sym )
+{
+    p = put32( p, sym->st_name );
+    if ( target->elfClass == ELFCLASS32 ) {
+        p = put32( p, sym->st_value );
+        p = put32( p, sym->st_size );
+    }
+    *p++ = sym->st_info;
+    *p++ = sym->st_other;
+    p = put16( p, sym->st_shndx );
+    if ( target->elfClass == ELFCLASS64 ) {
+        p = put64( p, sym->st_value );
+        p = put64( p, sym->st_size );
+    }
+    return p;
+}
+
+static Elf64_Sym *createSymbols( size_t *count )
 {
     struct Resource *it;
-    ElfW(Sym) sym;
+    Elf64_Sym *symbols, *sym;
+
+    *count = 0;
+    for ( it = resources; it != 0; it = it->next )
+        if ( it->ignore == FALSE )
+            ++*count;
 
+    if ( ( symbols = (Elf64_Sym *)malloc( *count * sizeof( Elf64_Sym ) + 1 ) ) == NULL ) {
+        fprintf( stderr, "Failed to allocate symbol table: %s\n", strerror( errno ) );
+        return NULL;
+    }
+
+    sym = symbols;
     for ( it = resources; it != 0; it = it->next ) {
         if ( it->ignore == TRUE )
             continue;
 
         /* Name (index into string table) */
-        sym.st_name = it->strtabOffset;
+        sym->st_name = it->strtabOffset;
         /* Symbol value (payload offset in section) */
-        sym.st_value = it->payloadOffset;
+        sym->st_value = it->section == RODATASECTION || it->section == BSSSECTION ? it->payloadOffset : 0;
         /* Payload size */
-        sym.st_size = it->size;
+        sym->st_size = it->size;
         /* Type and binding (global object) */
-        sym.st_info = ELF_ST_INFO( STB_GLOBAL, STT_OBJECT );
+        sym->st_info = ELF64_ST_INFO( STB_GLOBAL, STT_OBJECT );
         /* Default visibility */
-        sym.st_other = STV_DEFAULT;
+        sym->st_other = STV_DEFAULT;
         /* Payload section ( 4 == .rodata ) */
-        sym.st_shndx = 4;
-
-        if ( write( fd, &sym, sizeof( sym ) ) == -1 ) {
-            fprintf( stderr, "Failed to write symbols: %s\n", strerror( errno ) );
-            return -1;
-        }
+        sym->st_shndx = it->section;
+        ++sym;
     }
 
-    return 0;
+    return symbols;
 }
 
-static int writeStringTable( int fd )
+/* The prefix of the section names used by --section-per-resource. */
+static const char *sectionPrefix()
+{
+    return largeData ? ".lrodata." : ".rodata.";
+}
+
+/* Creates the headers, section symbols and names of the sections added
+ * by --section-per-resource. */
+static int createResourceSections( Elf64_Shdr **headers, Elf64_Sym **symbols,
+                                   char **names, size_t *count, size_t *namesSize )
 {
     struct Resource *it;
+    Elf64_Shdr *shdr;
+    Elf64_Sym *sym;
+    char *name;
+    size_t n = sectionCount - SECTIONHEADERCOUNT;
 
-    if ( write( fd, "\0", 1 ) == -1 ) {
-        fprintf( stderr, "Failed to write string table: %s\n", strerror( errno ) );
+    *headers = (Elf64_Shdr *)malloc( n * sizeof( Elf64_Shdr ) + 1 );
+    *symbols = (Elf64_Sym *)malloc( n * sizeof( Elf64_Sym ) + 1 );
+    *names = (char *)malloc( shstrtabHeader.sh_size - sizeof( shstrtabData ) + 1 );
+    if ( !*headers || !*symbols || !*names ) {
+        fprintf( stderr, "Failed to allocate section headers: %s\n", strerror( errno ) );
+        free( *headers );
+        free( *symbols );
+        free( *names );
         return -1;
     }
 
+    shdr = *headers;
+    sym = *symbols;
+    name = *names;
     for ( it = resources; it != 0; it = it->next ) {
-        if ( it->ignore == TRUE )
+        if ( it->alias || it->section == RODATASECTION || it->section == BSSSECTION )
             continue;
-        if ( write( fd, it->symbol, it->symbolSize ) == -1 ) {
-            fprintf( stderr, "Failed to write string table: %s\n", strerror( errno ) );
-            return -1;
-        }
+
+        shdr->sh_name = sizeof( shstrtabData ) + ( name - *names );
+        shdr->sh_type = SHT_PROGBITS;
+        shdr->sh_flags = rodataHeader.sh_flags;
+        shdr->sh_addr = 0;
+        shdr->sh_offset = rodataHeader.sh_offset + it->payloadOffset;
+        shdr->sh_size = it->size;
+        shdr->sh_link = 0;
+        shdr->sh_info = 0;
+        shdr->sh_addralign = it->align;
+        shdr->sh_entsize = 0;
+        ++shdr;
+
+        sym->st_name = 0;
+        sym->st_value = 0;
+        sym->st_size = 0;
+        sym->st_info = ELF64_ST_INFO( STB_LOCAL, STT_SECTION );
+        sym->st_other = STV_DEFAULT;
+        sym->st_shndx = it->section;
+        ++sym;
+
+        memcpy( name, sectionPrefix(), strlen( sectionPrefix() ) );
+        name += strlen( sectionPrefix() );
+        memcpy( name, it->symbol, it->symbolSize );
+        name += it->symbolSize;
     }
 
+    *count = n;
+    *namesSize = name - *names;
     return 0;
 }
 
-static int patchHeaders( const char *pathToSelf )
+static char *createStringTable( size_t *size )
 {
-    int maxalign = 1;
-    int align;
-    int payloadSize, symtabSize, strtabSize;
-    int fd;
-    ElfW(Ehdr) ownhdr;
     struct Resource *it;
+    char *strtab, *pos;
+    size_t len = 1;
 
-    /* Look into our own ELF header to determine the machine architecture .*/
-    if ( ( fd = open( pathToSelf, O_RDONLY ) ) == -1 ) {
-        fprintf( stderr, "Failed to open %s for reading: %s\n", pathToSelf, strerror( errno ) );
-        return -1;
+    for ( it = resources; it != 0; it = it->next )
+        if ( it->ignore == FALSE )
+            len += it->symbolSize;
+
+    if ( ( strtab = (char *)malloc( len ) ) == NULL ) {
+        fprintf( stderr, "Failed to allocate string table: %s\n", strerror( errno ) );
+        return NULL;
     }
-    if ( read( fd, &ownhdr, sizeof( ownhdr ) ) == -1 ) {
-        fprintf( stderr, "Failed to read from %s: %s\n", pathToSelf, strerror( errno ) );
-        return -1;
+
+    pos = strtab;
+    *pos++ = '\0';
+    for ( it = resources; it != 0; it = it->next ) {
+        if ( it->ignore == TRUE )
+            continue;
+        memcpy( pos, it->symbol, it->symbolSize );
+        pos += it->symbolSize;
     }
-    close( fd );
 
-    /* Architecture specific stuff, we just take the values
-     * of our own elfrc binary. */
-    hdr.e_machine = ownhdr.e_machine;
-    hdr.e_ident[EI_OSABI] = ownhdr.e_ident[EI_OSABI];
-    hdr.e_ident[EI_ABIVERSION] = ownhdr.e_ident[EI_ABIVERSION];
-    hdr.e_flags = ownhdr.e_flags;
+    *size = len;
+    return strtab;
+}
+
+static uint64_t alignUp( uint64_t v, uint64_t align )
+{
+    return ( v + align - 1 ) & ~( align - 1 );
+}
 
-    /* Calculate alignment needed for .rodata */
-    for ( it = resources; it != 0; it = it->next ) {
-        align = 1;
-        while ( align < sizeof(void *) * 8 && it->size > align )
-            align <<= 1;
-        if ( align > maxalign )
-            maxalign = align;
+/* Tells whether 'res' is a 'zero' or 'zero-ro' resource, which only
+ * occupies space in .bss. */
+static int zeroFilled( const struct Resource *res )
+{
+    return res->type == ZERO || res->type == ZERORO;
+}
+
+/* Resources without an explicit alignment get the next power of
+ * two of their size, up to eight times the target's word size. */
+static unsigned int alignment( struct Resource *res )
+{
+    if ( res->align == 0 ) {
+        res->align = 1;
+        while ( res->align < wordSize() * 8 && res->size > res->align )
+            res->align <<= 1;
     }
+    return res->align;
+}
+
+/* Computes the layout of the object file for the resources in the
+ * list. May be called repeatedly, e.g. once per object file. */
+static int patchHeaders()
+{
+    unsigned int maxalign = 1;
+    unsigned int extraSections = 0;
+    uint64_t symtabSize, strtabSize, namesSize, headerSize;
+    struct Resource *it;
 
-    /* Patch this first, since padding() depends on it. */
+    /* The sections need the largest alignment of any of their resources. */
+    bssHeader.sh_addralign = 4;
+    for ( it = resources; it != 0; it = it->next ) {
+        if ( zeroFilled( it ) ) {
+            if ( alignment( it ) > bssHeader.sh_addralign )
+                bssHeader.sh_addralign = it->align;
+        } else if ( alignment( it ) > maxalign ) {
+            maxalign = it->align;
+        }
+    }
     rodataHeader.sh_addralign = maxalign;
 
+    /* The large code models on x86-64 expect data which may lie
+     * beyond 2 GiB in sections flagged as large. */
+    if ( largeData ) {
+        rodataHeader.sh_name = LRODATANAME;
+        rodataHeader.sh_flags = SHF_ALLOC | SHF_X86_64_LARGE;
+    }
+
     /* Compute size of payload, symbol table and string table.
-       Also updates the cache fields it->payloadOffset and
-       it->strtabOffset in the resource list. */
+       Also updates the cache fields it->payloadOffset,
+       it->strtabOffset and it->section in the resource list. */
     payloadSize = 0;
-    symtabSize = sizeof ( symtabData );
+    bssSize = 0;
+    symtabSize = LOCALSYMBOLCOUNT * symSize();
     strtabSize = 1;
+    namesSize = sizeof( shstrtabData );
     for ( it = resources; it != 0; it = it->next ) {
-        it->payloadOffset = payloadSize;
-        payloadSize += it->size;
-        symtabSize += sizeof( symtabData[0] );
+        symtabSize += symSize();
         it->strtabOffset = strtabSize;
         strtabSize += it->symbolSize;
-        if ( it->next != 0 ) {
-            payloadSize += padding( it->size );
+
+        /* Duplicates share the payload of the original. */
+        if ( it->alias ) {
+            it->payloadOffset = it->alias->payloadOffset;
+            it->section = it->alias->section;
+            continue;
         }
-    }
 
-    /* Patch the remaining headers. */
-    rodataHeader.sh_size = payloadSize;
-    rodataHeader.sh_offset += symtabSize + strtabSize;
-    symtabHeader.sh_size = symtabSize;
-    strtabHeader.sh_offset += symtabSize;
-    strtabHeader.sh_size = strtabSize;
+        /* Zero filled resources take no room in the file at all. */
+        if ( zeroFilled( it ) ) {
+            it->payloadOffset = bssSize = alignUp( bssSize, it->align );
+            bssSize += it->size;
+            if ( it->align >= target->pageSize )
+                bssSize = alignUp( bssSize, it->align );
+            it->section = BSSSECTION;
+            continue;
+        }
 
-    return 0;
-}
+        paddingBytes += ( ( payloadSize + it->align - 1 ) & ~( it->align - 1 ) ) - payloadSize;
+        payloadSize = ( payloadSize + it->align - 1 ) & ~( it->align - 1 );
+        it->payloadOffset = payloadSize;
+        payloadSize += it->size;
 
-static int writeFiles( int fd )
-{
-    int i;
-    int npad;
-    struct Resource *it = resources;
+        /* Nothing else goes into the pages of page aligned resources,
+         * so that paging can be tuned for each of them. */
+        if ( it->align >= target->pageSize ) {
+            paddingBytes += alignUp( payloadSize, it->align ) - payloadSize;
+            payloadSize = alignUp( payloadSize, it->align );
+        }
 
-    for ( it = resources; it != 0; it = it->next ) {
-        if ( copyFileToFD( it->filename, fd ) == -1 ) {
-            it->ignore = TRUE;
+        /* Each .rodata.<symbol> section comes with a section symbol. */
+        if ( sectionPerResource ) {
+            it->section = SECTIONHEADERCOUNT + extraSections++;
+            namesSize += strlen( sectionPrefix() ) + it->symbolSize;
+            symtabSize += symSize();
         } else {
-            it->ignore = FALSE;
-
-            /* Resources of type 'text' get a trailing
-             * zero appended automatically. */
-            if ( it->type == TEXT )
-                write( fd, "\0", 1 );
-
-            if ( it->next ) {
-                /* Add padding bytes */
-                npad = padding( it->size );
-                for ( i = 0; i < npad; ++i )
-                    write( fd, "\0", 1 );
-            }
+            it->section = RODATASECTION;
         }
     }
 
+    sectionCount = SECTIONHEADERCOUNT + extraSections;
+    if ( sectionCount >= SHN_LORESERVE ) {
+        fprintf( stderr, "Too many sections for one object file; try --max-object-size.\n" );
+        return -1;
+    }
+
+    /* Patch the remaining headers. With one section per resource,
+     * .rodata stays empty and only delimits the payloads. */
+    headerSize = ehdrSize() + shdrSize() * sectionCount;
+    hdr.e_shnum = sectionCount;
+    commentHeader.sh_offset = headerSize;
+    shstrtabHeader.sh_offset = commentHeader.sh_offset + sizeof( commentData );
+    shstrtabHeader.sh_size = namesSize;
+    symtabHeader.sh_offset = shstrtabHeader.sh_offset + namesSize;
+    symtabHeader.sh_size = symtabSize;
+    symtabHeader.sh_info = LOCALSYMBOLCOUNT + extraSections;
+    strtabHeader.sh_offset = symtabHeader.sh_offset + symtabSize;
+    strtabHeader.sh_size = strtabSize;
+    rodataHeader.sh_offset = strtabHeader.sh_offset + strtabSize;
+    rodataHeader.sh_size = sectionPerResource ? 0 : payloadSize;
+    bssHeader.sh_size = bssSize;
+
+    /* ELF32 objects can't describe anything beyond 4 GiB. */
+    if ( target->elfClass == ELFCLASS32 &&
+         ( headerSize + sizeof( commentData ) + namesSize + symtabSize +
+           strtabSize + payloadSize > 0xffffffffULL || bssSize > 0xffffffffULL ) ) {
+        fprintf( stderr, "Resources are too large for this object file format.\n" );
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Moves the write position of 'fd' from 'pos' forward to 'offset',
+ * leaving zero bytes in between. For regular files that's just a
+ * seek over a hole (or over space preallocated by writeFiles()),
+ * anything unseekable gets fed from a block of zeroes.
+ */
+static int skipTo( int fd, off_t pos, off_t offset )
+{
+    static const char zeroes[ 4096 ];
+    ssize_t nwritten;
+
+    if ( lseek( fd, offset, SEEK_SET ) != -1 )
+        return 0;
+    if ( errno != ESPIPE )
+        return -1;
+
+    while ( pos < offset ) {
+        nwritten = offset - pos < sizeof( zeroes ) ? offset - pos : sizeof( zeroes );
+        if ( ( nwritten = write( fd, zeroes, nwritten ) ) == -1 )
+            return -1;
+        pos += nwritten;
+    }
+
+    return 0;
+}
+
+/* Writes the payload of 'it' to 'dst', see copyFileToFD(). */
+static int writePayload( struct Resource *it, int dst, off_t *offset )
+{
+    double start = statsOutput ? now() : 0;
+    int result;
+
+    if ( !it->data ) {
+        result = copyFileToFD( it->source, dst, offset );
+    } else {
+        if ( verbosity > 0 )
+            printf( "Merging %s into object file\n", it->filename );
+        if ( ( result = writeBuffer( dst, it->data, it->size, offset ) ) == -1 )
+            fprintf( stderr, "Failed to write %s to object file: %s\n", it->filename, strerror( errno ) );
+    }
+
+    if ( statsOutput )
+        it->copySeconds = now() - start;
+    return result;
+}
+
+#ifdef HAVE_IO_URING
+/* Copying lots of small files is dominated by the open(), read(),
+ * write() and close() calls rather than by moving data, so files up to
+ * URING_MAX_FILE bytes are copied in batches through an io_uring: all
+ * opens of a batch are submitted at once, then all reads, then all
+ * writes and closes, which makes it three system calls per batch.
+ */
+#define URING_BATCH 64
+#define URING_BUFFER ( 4 << 20 )
+#define URING_MAX_FILE ( 256 << 10 )
+
+struct Ring {
+    int fd;
+    unsigned int *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned int *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqMap, *cqMap;
+    size_t sqMapSize, cqMapSize, sqesSize;
+    unsigned int pending;
+};
+
+struct RingSlot {
+    struct Resource *res;
+    int fd;
+    char *buffer;
+    size_t len;
+    size_t done;                /* Bytes read into 'buffer' so far */
+    off_t offset;
+    int failed;
+};
+
+static void ringClose( struct Ring *ring )
+{
+    if ( ring->sqes )
+        munmap( ring->sqes, ring->sqesSize );
+    if ( ring->cqMap && ring->cqMap != ring->sqMap )
+        munmap( ring->cqMap, ring->cqMapSize );
+    if ( ring->sqMap )
+        munmap( ring->sqMap, ring->sqMapSize );
+    close( ring->fd );
+}
+
+/* Sets up a ring with room for 'entries' requests; returns -1 if the
+ * kernel doesn't support io_uring (or the operations needed here). */
+static int ringSetup( struct Ring *ring, unsigned int entries )
+{
+    static const int ops[] = { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE };
+    struct io_uring_params params;
+    struct io_uring_probe *probe;
+    unsigned int i;
+    char *sq, *cq;
+
+    memset( ring, 0, sizeof( *ring ) );
+    memset( &params, 0, sizeof( params ) );
+    if ( ( ring->fd = syscall( __NR_io_uring_setup, entries, &params ) ) == -1 )
+        return -1;
+
+    if ( ( probe = (struct io_uring_probe *)calloc( 1, sizeof( *probe ) +
+                        IORING_OP_LAST * sizeof( struct io_uring_probe_op ) ) ) == NULL ||
+         syscall( __NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST ) == -1 ) {
+        free( probe );
+        close( ring->fd );
+        return -1;
+    }
+    for ( i = 0; i < sizeof( ops ) / sizeof( ops[0] ); ++i ) {
+        if ( ops[ i ] > probe->last_op || !( probe->ops[ ops[ i ] ].flags & IO_URING_OP_SUPPORTED ) ) {
+            free( probe );
+            close( ring->fd );
+            return -1;
+        }
+    }
+    free( probe );
+
+    ring->sqMapSize = params.sq_off.array + params.sq_entries * sizeof( unsigned int );
+    ring->cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof( struct io_uring_cqe );
+    if ( params.features & IORING_FEAT_SINGLE_MMAP ) {
+        if ( ring->cqMapSize > ring->sqMapSize )
+            ring->sqMapSize = ring->cqMapSize;
+        ring->cqMapSize = ring->sqMapSize;
+    }
+
+    ring->sqMap = mmap( 0, ring->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING );
+    if ( ring->sqMap == MAP_FAILED ) {
+        ring->sqMap = 0;
+        ringClose( ring );
+        return -1;
+    }
+    if ( params.features & IORING_FEAT_SINGLE_MMAP ) {
+        ring->cqMap = ring->sqMap;
+    } else {
+        ring->cqMap = mmap( 0, ring->cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING );
+        if ( ring->cqMap == MAP_FAILED ) {
+            ring->cqMap = 0;
+            ringClose( ring );
+            return -1;
+        }
+    }
+    ring->sqesSize = params.sq_entries * sizeof( struct io_uring_sqe );
+    ring->sqes = (struct io_uring_sqe *)mmap( 0, ring->sqesSize, PROT_READ | PROT_WRITE,
+                                              MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES );
+    if ( ring->sqes == MAP_FAILED ) {
+        ring->sqes = 0;
+        ringClose( ring );
+        return -1;
+    }
+
+    sq = (char *)ring->sqMap;
+    cq = (char *)ring->cqMap;
+    ring->sqHead = (unsigned int *)( sq + params.sq_off.head );
+    ring->sqTail = (unsigned int *)( sq + params.sq_off.tail );
+    ring->sqMask = (unsigned int *)( sq + params.sq_off.ring_mask );
+    ring->sqArray = (unsigned int *)( sq + params.sq_off.array );
+    ring->cqHead = (unsigned int *)( cq + params.cq_off.head );
+    ring->cqTail = (unsigned int *)( cq + params.cq_off.tail );
+    ring->cqMask = (unsigned int *)( cq + params.cq_off.ring_mask );
+    ring->cqes = (struct io_uring_cqe *)( cq + params.cq_off.cqes );
+    return 0;
+}
+
+/* Returns a cleared submission queue entry. The caller never queues
+ * more entries than the ring was set up for between two ringWait(). */
+static struct io_uring_sqe *ringQueue( struct Ring *ring, int opcode, unsigned long long userData )
+{
+    unsigned int tail = *ring->sqTail, index = tail & *ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[ index ];
+
+    memset( sqe, 0, sizeof( *sqe ) );
+    sqe->opcode = opcode;
+    sqe->user_data = userData;
+    ring->sqArray[ index ] = index;
+    __atomic_store_n( ring->sqTail, tail + 1, __ATOMIC_RELEASE );
+    ++ring->pending;
+    return sqe;
+}
+
+/* Submits everything queued and waits for all of it to complete,
+ * passing each result to 'complete'. */
+static int ringWait( struct Ring *ring, struct RingSlot *slots,
+                     void (*complete)( struct RingSlot *slot, int res ) )
+{
+    unsigned int head, remaining = ring->pending, submit = ring->pending;
+    const struct io_uring_cqe *cqe;
+    long n;
+
+    while ( remaining > 0 ) {
+        n = syscall( __NR_io_uring_enter, ring->fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0 );
+        if ( n == -1 ) {
+            if ( errno == EINTR )
+                continue;
+            return -1;
+        }
+        submit -= n;
+
+        head = *ring->cqHead;
+        while ( head != __atomic_load_n( ring->cqTail, __ATOMIC_ACQUIRE ) ) {
+            cqe = &ring->cqes[ head & *ring->cqMask ];
+            complete( &slots[ cqe->user_data ], cqe->res );
+            ++head;
+            --remaining;
+        }
+        __atomic_store_n( ring->cqHead, head, __ATOMIC_RELEASE );
+    }
+
+    ring->pending = 0;
+    return 0;
+}
+
+static void openCompleted( struct RingSlot *slot, int res )
+{
+    if ( res < 0 ) {
+        fprintf( stderr, "Failed to open %s for reading: %s\n", slot->res->filename, strerror( -res ) );
+        slot->failed = 1;
+    } else {
+        slot->fd = res;
+    }
+}
+
+/* Partial reads are remembered and finished by copyBatch(). */
+static void readCompleted( struct RingSlot *slot, int res )
+{
+    if ( res < 0 ) {
+        fprintf( stderr, "Failed to read from %s: %s\n", slot->res->filename, strerror( -res ) );
+        slot->failed = 1;
+    } else {
+        slot->done = res;
+    }
+}
+
+/* Partial writes are remembered and finished by copyBatch(). */
+static void writeCompleted( struct RingSlot *slot, int res )
+{
+    if ( res < 0 ) {
+        fprintf( stderr, "Failed to write %s to object file: %s\n", slot->res->filename, strerror( -res ) );
+        slot->failed = 1;
+    } else {
+        slot->len -= res;
+        slot->buffer += res;
+        slot->offset += res;
+    }
+}
+
+static void closeCompleted( struct RingSlot *slot, int res )
+{
+    (void)slot;
+    (void)res;
+}
+
+/* Closes the files a batch opened when bailing out. */
+static void closeSlots( struct RingSlot *slots, unsigned int count )
+{
+    unsigned int i;
+
+    for ( i = 0; i < count; ++i )
+        if ( slots[ i ].fd != -1 )
+            close( slots[ i ].fd );
+}
+
+/* Copies the batch of 'count' resources in 'slots' into 'dst'. Returns
+ * -1 if any of them couldn't be copied. */
+static int copyBatch( struct Ring *ring, struct RingSlot *slots, unsigned int count, int dst )
+{
+    struct io_uring_sqe *sqe;
+    double start = statsOutput ? now() : 0;
+    unsigned int i;
+    ssize_t nread;
+
+    for ( i = 0; i < count; ++i ) {
+        if ( verbosity > 0 )
+            printf( "Merging %s into object file\n", slots[ i ].res->filename );
+        sqe = ringQueue( ring, IORING_OP_OPENAT, i );
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)slots[ i ].res->source;
+        sqe->open_flags = O_RDONLY;
+    }
+    if ( ringWait( ring, slots, openCompleted ) == -1 )
+        goto failed;
+
+    for ( i = 0; i < count; ++i ) {
+        if ( slots[ i ].fd == -1 )
+            continue;
+        sqe = ringQueue( ring, IORING_OP_READ, i );
+        sqe->fd = slots[ i ].fd;
+        sqe->addr = (uintptr_t)slots[ i ].buffer;
+        sqe->len = slots[ i ].len;
+    }
+    if ( ringWait( ring, slots, readCompleted ) == -1 )
+        goto failed;
+
+    /* Short reads are finished by hand as well; a file which ends
+     * early got shorter since it was looked at. */
+    for ( i = 0; i < count; ++i ) {
+        if ( slots[ i ].fd == -1 || slots[ i ].failed )
+            continue;
+        nread = 1;
+        while ( slots[ i ].done < slots[ i ].len &&
+                ( nread = read( slots[ i ].fd, slots[ i ].buffer + slots[ i ].done,
+                                slots[ i ].len - slots[ i ].done ) ) > 0 )
+            slots[ i ].done += nread;
+        if ( nread == -1 || slots[ i ].done < slots[ i ].len ) {
+            fprintf( stderr, "Failed to read from %s: %s\n", slots[ i ].res->filename,
+                     nread == -1 ? strerror( errno ) : "File got shorter" );
+            slots[ i ].failed = 1;
+        }
+    }
+
+    for ( i = 0; i < count; ++i ) {
+        if ( slots[ i ].fd == -1 || slots[ i ].failed )
+            continue;
+        sqe = ringQueue( ring, IORING_OP_WRITE, i );
+        sqe->fd = dst;
+        sqe->addr = (uintptr_t)slots[ i ].buffer;
+        sqe->len = slots[ i ].len;
+        sqe->off = slots[ i ].offset;
+    }
+    if ( ringWait( ring, slots, writeCompleted ) == -1 )
+        goto failed;
+
+    for ( i = 0; i < count; ++i ) {
+        if ( slots[ i ].fd == -1 )
+            continue;
+        ringQueue( ring, IORING_OP_CLOSE, i )->fd = slots[ i ].fd;
+    }
+    if ( ringWait( ring, slots, closeCompleted ) == -1 ) {
+        fprintf( stderr, "Failed to submit I/O requests: %s\n", strerror( errno ) );
+        return -1;
+    }
+
+    /* Short writes are rare enough to just finish them by hand. */
+    for ( i = 0; i < count; ++i ) {
+        if ( slots[ i ].fd == -1 || slots[ i ].failed || slots[ i ].len == 0 )
+            continue;
+        if ( writeBuffer( dst, slots[ i ].buffer, slots[ i ].len, &slots[ i ].offset ) == -1 ) {
+            fprintf( stderr, "Failed to write %s to object file: %s\n",
+                     slots[ i ].res->filename, strerror( errno ) );
+            slots[ i ].failed = 1;
+        }
+    }
+
+    /* The files of a batch are copied together; share the time. */
+    if ( statsOutput ) {
+        for ( i = 0; i < count; ++i )
+            slots[ i ].res->copySeconds = ( now() - start ) / count;
+    }
+
+    for ( i = 0; i < count; ++i )
+        if ( slots[ i ].failed )
+            return -1;
+    return 0;
+
+failed:
+    fprintf( stderr, "Failed to submit I/O requests: %s\n", strerror( errno ) );
+    closeSlots( slots, count );
+    return -1;
+}
+
+/* Writes all payloads into 'dst' at their offsets, small files through
+ * an io_uring and everything else as writeFilesParallel() does. Files on
+ * the same file system as 'dst' are left to copy_file_range(), which may
+ * share their blocks rather than copy them. Returns 1 without doing
+ * anything if io_uring isn't available. */
+static int writeFilesUring( int dst )
+{
+    struct RingSlot slots[ URING_BATCH ];
+    struct Ring ring;
+    struct Resource *it;
+    struct stat sb;
+    unsigned int count = 0;
+    size_t used = 0, len;
+    char *buffer;
+    off_t offset;
+    int result = 0;
+
+    if ( fstat( dst, &sb ) == -1 || ringSetup( &ring, URING_BATCH ) == -1 )
+        return 1;
+    if ( ( buffer = (char *)malloc( URING_BUFFER ) ) == NULL ) {
+        ringClose( &ring );
+        return 1;
+    }
+
+    for ( it = resources; it != 0 && result == 0; it = it->next ) {
+        if ( it->alias || zeroFilled( it ) )
+            continue;
+
+        offset = rodataHeader.sh_offset + it->payloadOffset;
+        len = it->type == TEXT ? it->size - 1 : it->size;
+        if ( it->data || len > URING_MAX_FILE || it->device == sb.st_dev ) {
+            result = writePayload( it, dst, &offset );
+            continue;
+        }
+
+        if ( count == URING_BATCH || used + len > URING_BUFFER ) {
+            result = copyBatch( &ring, slots, count, dst );
+            count = 0;
+            used = 0;
+        }
+        slots[ count ].res = it;
+        slots[ count ].fd = -1;
+        slots[ count ].buffer = buffer + used;
+        slots[ count ].len = len;
+        slots[ count ].done = 0;
+        slots[ count ].offset = offset;
+        slots[ count ].failed = 0;
+        ++count;
+        used += len;
+    }
+    if ( result == 0 && count > 0 )
+        result = copyBatch( &ring, slots, count, dst );
+
+    free( buffer );
+    ringClose( &ring );
+    return result;
+}
+#endif
+
+/* Runs 'worker' on 'queue' in up to 'jobs' threads, but not more
+ * than there are 'count' items of work, and waits for all of them. */
+static void runWorkers( void *(*worker)( void * ), void *queue, size_t count )
+{
+    pthread_t *threads;
+    int i, nthreads = 0;
+
+    if ( jobs > 1 && ( threads = (pthread_t *)malloc( jobs * sizeof( pthread_t ) ) ) != NULL ) {
+        for ( ; nthreads < jobs && nthreads < count; ++nthreads ) {
+            if ( pthread_create( &threads[ nthreads ], NULL, worker, queue ) != 0 )
+                break;
+        }
+    } else {
+        threads = 0;
+    }
+
+    /* If no thread could be started at all, do the work ourselves. */
+    if ( nthreads == 0 )
+        worker( queue );
+    for ( i = 0; i < nthreads; ++i )
+        pthread_join( threads[ i ], NULL );
+
+    free( threads );
+}
+
+/* Shared state of the threads started by writeFilesParallel(). */
+struct PayloadQueue {
+    pthread_mutex_t lock;
+    struct Resource **items;
+    size_t count;
+    size_t next;
+    int fd;
+    int failed;
+};
+
+static void *payloadWorker( void *arg )
+{
+    struct PayloadQueue *queue = (struct PayloadQueue *)arg;
+    struct Resource *it;
+    off_t offset;
+
+    for ( ;; ) {
+        pthread_mutex_lock( &queue->lock );
+        it = !queue->failed && queue->next < queue->count ? queue->items[ queue->next++ ] : 0;
+        pthread_mutex_unlock( &queue->lock );
+        if ( !it )
+            break;
+
+        offset = rodataHeader.sh_offset + it->payloadOffset;
+        if ( writePayload( it, queue->fd, &offset ) == -1 ) {
+            /* The object file is discarded anyway. */
+            pthread_mutex_lock( &queue->lock );
+            queue->failed = 1;
+            pthread_mutex_unlock( &queue->lock );
+        }
+    }
+
+    return 0;
+}
+
+static int compareSizeDescending( const void *a, const void *b )
+{
+    const struct Resource *l = *(const struct Resource * const *)a;
+    const struct Resource *r = *(const struct Resource * const *)b;
+
+    if ( l->size != r->size )
+        return l->size < r->size ? 1 : -1;
+    return 0;
+}
+
+/* Copies the payloads into 'fd' using 'jobs' threads, each of which
+ * writes to the precomputed offsets directly. The largest resources
+ * are handed out first so that no thread is left with a huge file
+ * at the very end.
+ */
+static int writeFilesParallel( int fd )
+{
+    struct PayloadQueue queue;
+    struct Resource *it;
+
+    queue.count = 0;
+    for ( it = resources; it != 0; it = it->next )
+        if ( !it->alias && !zeroFilled( it ) )
+            ++queue.count;
+    queue.next = 0;
+    queue.fd = fd;
+    queue.failed = 0;
+
+    if ( ( queue.items = (struct Resource **)malloc( queue.count * sizeof( it ) + 1 ) ) == NULL ) {
+        fprintf( stderr, "Failed to allocate work queue: %s\n", strerror( errno ) );
+        return -1;
+    }
+
+    queue.count = 0;
+    for ( it = resources; it != 0; it = it->next )
+        if ( !it->alias && !zeroFilled( it ) )
+            queue.items[ queue.count++ ] = it;
+    qsort( queue.items, queue.count, sizeof( it ), compareSizeDescending );
+
+    pthread_mutex_init( &queue.lock, NULL );
+    runWorkers( payloadWorker, &queue, queue.count );
+    pthread_mutex_destroy( &queue.lock );
+
+    free( queue.items );
+    return queue.failed ? -1 : 0;
+}
+
+static int writeFiles( int fd )
+{
+    struct Resource *it;
+    off_t pos, end;
+#ifdef HAVE_IO_URING
+    int result;
+#endif
+
+    /* The layout was fixed by patchHeaders() already, so the final
+     * size of the file is known before any payload is written.
+     * Padding and the trailing zero of 'text' resources are never
+     * written explicitly, they come from the gaps between the
+     * payloads. */
+    pos = rodataHeader.sh_offset;
+    end = rodataHeader.sh_offset + payloadSize;
+#ifdef __Linux__
+    if ( fallocate( fd, 0, 0, end ) == -1 )
+#endif
+        ftruncate( fd, end );
+
+    /* Positioned writes need a seekable output. */
+    if ( jobs > 1 && lseek( fd, 0, SEEK_CUR ) != -1 )
+        return writeFilesParallel( fd );
+
+#ifdef HAVE_IO_URING
+    if ( ioUring && lseek( fd, 0, SEEK_CUR ) != -1 && ( result = writeFilesUring( fd ) ) != 1 )
+        return result;
+#endif
+
+    for ( it = resources; it != 0; it = it->next ) {
+        if ( it->alias || zeroFilled( it ) )
+            continue;
+        if ( skipTo( fd, pos, rodataHeader.sh_offset + it->payloadOffset ) == -1 ) {
+            fprintf( stderr, "Failed to seek in object file: %s\n", strerror( errno ) );
+            return -1;
+        }
+        pos = rodataHeader.sh_offset + it->payloadOffset;
+
+        if ( writePayload( it, fd, NULL ) == -1 )
+            return -1;
+        pos += it->type == TEXT ? it->size - 1 : it->size;
+    }
+
+    if ( skipTo( fd, pos, end ) == -1 ) {
+        fprintf( stderr, "Failed to seek in object file: %s\n", strerror( errno ) );
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Tells whether the files 'a' and 'b' have the same contents. */
+static int sameContents( const char *a, const char *b )
+{
+    int fda, fdb;
+    char bufa[ 32768 ], bufb[ 32768 ];
+    ssize_t na, nb;
+    int same = 0;
+
+    if ( ( fda = open( a, O_RDONLY ) ) == -1 )
+        return 0;
+    if ( ( fdb = open( b, O_RDONLY ) ) == -1 ) {
+        close( fda );
+        return 0;
+    }
+
+    for ( ;; ) {
+        na = read( fda, bufa, sizeof( bufa ) );
+        nb = read( fdb, bufb, sizeof( bufb ) );
+        if ( na == -1 || na != nb || memcmp( bufa, bufb, na ) != 0 )
+            break;
+        if ( na == 0 ) {
+            same = 1;
+            break;
+        }
+    }
+
+    close( fda );
+    close( fdb );
+    return same;
+}
+
+/* Creates the file which is written in place of 'fn', with the
+ * permissions 'mode' (less the umask), storing its name in '*tmp'. That's
+ * a temporary file next to 'fn' which commitOutput() renames to 'fn',
+ * so that readers never see a partly written file; devices, pipes and
+ * the like are written directly, and '*tmp' is NULL then. If 'fn' is a
+ * symbolic link, the file it points to is replaced instead, so '*tmp'
+ * is followed by the name of the file to replace. */
+static int createOutput( const char *fn, mode_t mode, char **tmp )
+{
+    struct stat sb;
+    char *target = NULL;
+    size_t len;
+    mode_t mask;
+    int fd;
+
+    *tmp = NULL;
+    /* Dangling links are left to open() to follow. */
+    if ( ( lstat( fn, &sb ) == 0 && S_ISLNK( sb.st_mode ) && ( target = realpath( fn, NULL ) ) == NULL ) ||
+         ( stat( fn, &sb ) == 0 && !S_ISREG( sb.st_mode ) ) ) {
+        free( target );
+        if ( ( fd = open( fn, O_WRONLY | O_CREAT | O_TRUNC, mode ) ) == -1 )
+            fprintf( stderr, "Failed to open %s for writing: %s\n", fn, strerror( errno ) );
+        return fd;
+    }
+
+    len = strlen( target ? target : fn );
+    if ( ( *tmp = (char *)malloc( 2 * len + 9 ) ) == NULL ) {
+        fprintf( stderr, "Failed to allocate memory: %s\n", strerror( errno ) );
+        free( target );
+        return -1;
+    }
+    sprintf( *tmp, "%s.XXXXXX", target ? target : fn );
+    strcpy( *tmp + len + 8, target ? target : fn );
+    free( target );
+    if ( ( fd = mkstemp( *tmp ) ) == -1 ) {
+        fprintf( stderr, "Failed to create temporary file for %s: %s\n", fn, strerror( errno ) );
+        free( *tmp );
+        *tmp = NULL;
+        return -1;
+    }
+    mask = umask( 0 );
+    umask( mask );
+    fchmod( fd, mode & ~mask );
+    return fd;
+}
+
+/* Closes 'fd' and removes the temporary file 'tmp' after a failure. */
+static void discardOutput( int fd, char *tmp )
+{
+    if ( fd != -1 )
+        close( fd );
+    if ( tmp )
+        unlink( tmp );
+    free( tmp );
+}
+
+/* Replaces 'fn' with the temporary file 'tmp' written in its place.
+ * If 'fn' has the same contents already, it's left alone, so that its
+ * modification time doesn't trigger needless rebuilds. */
+static int replaceOutput( char *tmp, const char *fn )
+{
+    struct stat a, b;
+    const char *target;
+    int result = 0;
+
+    if ( !tmp )
+        return 0;
+
+    target = tmp + strlen( tmp ) + 1;
+    if ( stat( tmp, &a ) == 0 && stat( target, &b ) == 0 && a.st_size == b.st_size &&
+         sameContents( tmp, target ) ) {
+        if ( verbosity > 0 )
+            printf( "%s is unchanged\n", fn );
+        unlink( tmp );
+    } else if ( rename( tmp, target ) == -1 ) {
+        fprintf( stderr, "Failed to rename %s to %s: %s\n", tmp, target, strerror( errno ) );
+        unlink( tmp );
+        result = -1;
+    }
+    free( tmp );
+    return result;
+}
+
+/* Closes 'fd' and puts the file written through it in place. */
+static int commitOutput( int fd, char *tmp, const char *fn )
+{
+    if ( close( fd ) == -1 ) {
+        fprintf( stderr, "Failed to write %s: %s\n", fn, strerror( errno ) );
+        discardOutput( -1, tmp );
+        return -1;
+    }
+    return replaceOutput( tmp, fn );
+}
+
+/* The same for output written through the stream 'f'. */
+static int commitStream( FILE *f, char *tmp, const char *fn )
+{
+    int failed = ferror( f );
+
+    if ( fclose( f ) == EOF || failed ) {
+        fprintf( stderr, "Failed to write %s: %s\n", fn, strerror( errno ) );
+        discardOutput( -1, tmp );
+        return -1;
+    }
+    return replaceOutput( tmp, fn );
+}
+
+/* Opens a stream for the text file 'fn', see createOutput(). */
+static FILE *openStream( const char *fn, char **tmp )
+{
+    FILE *f;
+    int fd;
+
+    if ( ( fd = createOutput( fn, 0666, tmp ) ) == -1 )
+        return NULL;
+    if ( ( f = fdopen( fd, "w" ) ) == NULL ) {
+        fprintf( stderr, "Failed to open %s for writing: %s\n", fn, strerror( errno ) );
+        discardOutput( fd, *tmp );
+    }
+    return f;
+}
+
+static int writeELFRelocatable( const char *fn )
+{
+    int fd;
+    char *tmp;
+    int result;
+    struct iovec iov[ 8 ];
+    int iovcnt = 0;
+    Elf64_Sym *symbols;
+    size_t symbolCount;
+    char *strtab;
+    size_t strtabSize;
+    Elf64_Shdr *sectionHeaders;
+    Elf64_Sym *sectionSymbols;
+    char *sectionNames;
+    size_t sectionsSize, sectionNamesSize;
+    const Elf64_Shdr *staticHeaders[ SECTIONHEADERCOUNT ] = {
+        &nullHeader, &textHeader, &dataHeader, &bssHeader, &rodataHeader,
+        &commentHeader, &shstrtabHeader, &symtabHeader, &strtabHeader
+    };
+    unsigned char *headers, *symtab, *p;
+    size_t headersSize, symtabSize, i;
+    struct PhaseMark mark;
+
+    if ( !fn )
+        return 0;
+
+    if ( verbosity > 0 )
+        printf( "Writing ELF relocatable file %s\n", fn );
+
+    if ( ( fd = createOutput( fn, 0644, &tmp ) ) == -1 )
+        return -1;
+
+    /* Everything up to the payload is assembled in memory and
+     * handed to the kernel in one go. */
+    markPhase( &mark );
+    if ( ( symbols = createSymbols( &symbolCount ) ) == NULL ) {
+        discardOutput( fd, tmp );
+        return -1;
+    }
+    endPhase( &mark, "write.symbols" );
+    markPhase( &mark );
+    if ( ( strtab = createStringTable( &strtabSize ) ) == NULL ) {
+        free( symbols );
+        discardOutput( fd, tmp );
+        return -1;
+    }
+    endPhase( &mark, "write.strtab" );
+    markPhase( &mark );
+    if ( createResourceSections( &sectionHeaders, &sectionSymbols, &sectionNames,
+                                 &sectionsSize, &sectionNamesSize ) == -1 ) {
+        free( symbols );
+        free( strtab );
+        discardOutput( fd, tmp );
+        return -1;
+    }
+
+    /* Convert the headers and symbols to the class and byte order
+     * of the target. */
+    headersSize = ehdrSize() + shdrSize() * ( SECTIONHEADERCOUNT + sectionsSize );
+    symtabSize = symSize() * ( LOCALSYMBOLCOUNT + sectionsSize + symbolCount );
+    headers = (unsigned char *)malloc( headersSize );
+    symtab = (unsigned char *)malloc( symtabSize );
+    if ( headers && symtab ) {
+        p = encodeEhdr( headers, &hdr );
+        for ( i = 0; i < SECTIONHEADERCOUNT; ++i )
+            p = encodeShdr( p, staticHeaders[ i ] );
+        for ( i = 0; i < sectionsSize; ++i )
+            p = encodeShdr( p, &sectionHeaders[ i ] );
+
+        p = symtab;
+        for ( i = 0; i < LOCALSYMBOLCOUNT; ++i )
+            p = encodeSym( p, &symtabData[ i ] );
+        for ( i = 0; i < sectionsSize; ++i )
+            p = encodeSym( p, &sectionSymbols[ i ] );
+        for ( i = 0; i < symbolCount; ++i )
+            p = encodeSym( p, &symbols[ i ] );
+    }
+    free( symbols );
+    free( sectionHeaders );
+    free( sectionSymbols );
+    if ( !headers || !symtab ) {
+        fprintf( stderr, "Failed to allocate headers: %s\n", strerror( errno ) );
+        free( headers );
+        free( symtab );
+        free( strtab );
+        free( sectionNames );
+        discardOutput( fd, tmp );
+        return -1;
+    }
+
+#define ADDBLOCK( b, len ) \
+    iov[ iovcnt ].iov_base = (void *)( b ); \
+    iov[ iovcnt ].iov_len = ( len ); \
+    ++iovcnt;
+
+    ADDBLOCK( headers, headersSize )
+
+    ADDBLOCK( commentData, sizeof( commentData ) )
+    ADDBLOCK( shstrtabData, sizeof( shstrtabData ) )
+    ADDBLOCK( sectionNames, sectionNamesSize )
+
+    ADDBLOCK( symtab, symtabSize )
+    ADDBLOCK( strtab, strtabSize )
+
+#undef ADDBLOCK
+
+    result = writeVector( fd, iov, iovcnt );
+    if ( result == -1 )
+        fprintf( stderr, "Failed to write headers to %s: %s\n", fn, strerror( errno ) );
+    endPhase( &mark, "write.headers" );
+    free( headers );
+    free( symtab );
+    free( strtab );
+    free( sectionNames );
+    if ( result == -1 ) {
+        discardOutput( fd, tmp );
+        return -1;
+    }
+
+    markPhase( &mark );
+    if ( writeFiles( fd ) == -1 ) {
+        discardOutput( fd, tmp );
+        return -1;
+    }
+    endPhase( &mark, "write.payload" );
+
+    return commitOutput( fd, tmp, fn );
+}
+
+/* The sections of the shared objects written by --shared. */
+enum { SO_HASH = 1, SO_DYNSYM, SO_DYNSTR, SO_DYNAMIC, SO_RODATA, SO_SHSTRTAB, SO_SECTIONCOUNT };
+
+#define SO_SEGMENTCOUNT 5
+#define SO_DYNAMICCOUNT 7
+
+static const char soShstrtabData[] =
+    "\0"
+    ".hash\0"       /*  1 */
+    ".dynsym\0"     /*  7 */
+    ".dynstr\0"     /* 15 */
+    ".dynamic\0"    /* 23 */
+    ".rodata\0"     /* 32 */
+    ".shstrtab";    /* 40 */
+
+static const Elf64_Word soSectionNames[ SO_SECTIONCOUNT ] = { 0, 1, 7, 15, 23, 32, 40 };
+
+/* The hash function of the System V ABI used by DT_HASH. */
+static uint32_t elfHash( const char *name )
+{
+    uint32_t h = 0, g;
+
+    for ( ; *name; ++name ) {
+        h = ( h << 4 ) + (unsigned char)*name;
+        if ( ( g = h & 0xf0000000 ) != 0 )
+            h ^= g >> 24;
+        h &= ~g;
+    }
+    return h;
+}
+
+/* Writes the resources as shared object 'fn' which can be loaded with
+ * dlopen(), so that they're neither part of the link nor paged in
+ * before they are used. Its file looks like
+ *
+ *   ELF header, program headers, .hash, .dynsym, .dynstr  (read-only)
+ *   .shstrtab, section headers                          (not loaded)
+ *   .dynamic                 (writable, the dynamic loader patches it)
+ *   .rodata, starting at a page boundary                   (read-only)
+ *
+ * Everything from .dynamic on is mapped 'shift' bytes above its file
+ * offset, so that .dynamic doesn't share a page with the read-only
+ * data while it can share one in the file. */
+static int writeSharedObject( const char *fn )
+{
+    Elf64_Ehdr ehdr = hdr;
+    Elf64_Phdr phdrs[ SO_SEGMENTCOUNT ];
+    Elf64_Shdr shdrs[ SO_SECTIONCOUNT ];
+    Elf64_Sym sym;
+    Elf64_Sxword dynamic[ SO_DYNAMICCOUNT ][ 2 ];
+    struct Resource *it;
+    const char *soname;
+    char *strtab;
+    size_t strtabSize, sonameSize, hashEntrySize, nsyms = 1, i;
+    uint64_t hashOffset, dynsymOffset, dynstrOffset, dynstrSize, shstrtabOffset,
+             shdrOffset, dynamicOffset, dynamicSize, rodataOffset, align, shift;
+    uint32_t *buckets, *chains, h;
+    unsigned char *meta, *p;
+    struct PhaseMark mark;
+    int fd;
+    char *tmp;
+
+    if ( !fn )
+        return 0;
+
+    /* There's no writable segment for .bss to go into. */
+    for ( it = resources; it != 0; it = it->next ) {
+        if ( zeroFilled( it ) ) {
+            fprintf( stderr, "Resource %s: 'zero' and 'zero-ro' resources can't be put into a shared object.\n",
+                     it->symbol );
+            return -1;
+        }
+    }
+
+    if ( verbosity > 0 )
+        printf( "Writing ELF shared object %s\n", fn );
+
+    soname = strrchr( fn, '/' ) ? strrchr( fn, '/' ) + 1 : fn;
+    sonameSize = strlen( soname ) + 1;
+
+    for ( it = resources; it != 0; it = it->next )
+        if ( it->ignore == FALSE )
+            ++nsyms;
+
+    markPhase( &mark );
+    if ( ( strtab = createStringTable( &strtabSize ) ) == NULL )
+        return -1;
+
+    /* s390x is the odd one out with 64 bit hash table entries. */
+    hashEntrySize = target->machine == EM_S390 && target->elfClass == ELFCLASS64 ? 8 : 4;
+    hashOffset = alignUp( ehdrSize() + phdrSize() * SO_SEGMENTCOUNT, hashEntrySize );
+    dynsymOffset = alignUp( hashOffset + hashEntrySize * ( 2 + 2 * nsyms ), wordSize() );
+    dynstrOffset = dynsymOffset + symSize() * nsyms;
+    dynstrSize = 1 + sonameSize + strtabSize - 1;
+    shstrtabOffset = dynstrOffset + dynstrSize;
+    shdrOffset = alignUp( shstrtabOffset + sizeof( soShstrtabData ), wordSize() );
+    dynamicOffset = shdrOffset + shdrSize() * SO_SECTIONCOUNT;
+    dynamicSize = 2 * wordSize() * SO_DYNAMICCOUNT;
+
+    align = target->pageSize > rodataHeader.sh_addralign ? target->pageSize : rodataHeader.sh_addralign;
+    shift = align;
+    rodataOffset = alignUp( dynamicOffset + dynamicSize, align );
+    rodataHeader.sh_offset = rodataOffset;
+
+    if ( target->elfClass == ELFCLASS32 && rodataOffset + shift + payloadSize > 0xffffffffULL ) {
+        fprintf( stderr, "Resources are too large for this object file format.\n" );
+        free( strtab );
+        return -1;
+    }
+
+    if ( ( meta = (unsigned char *)calloc( 1, dynamicOffset + dynamicSize ) ) == NULL ||
+         ( buckets = (uint32_t *)calloc( 2 * nsyms, sizeof( uint32_t ) ) ) == NULL ) {
+        fprintf( stderr, "Failed to allocate headers: %s\n", strerror( errno ) );
+        free( meta );
+        free( strtab );
+        return -1;
+    }
+    chains = buckets + nsyms;
+
+    /* The dynamic symbol table, and the hash table to find them in
+     * with one bucket per symbol. */
+    memset( &sym, 0, sizeof( sym ) );
+    p = encodeSym( meta + dynsymOffset, &sym );
+    i = 1;
+    for ( it = resources; it != 0; it = it->next ) {
+        if ( it->ignore == TRUE )
+            continue;
+        sym.st_name = sonameSize + it->strtabOffset;
+        sym.st_value = rodataOffset + shift + it->payloadOffset;
+        sym.st_size = it->size;
+        sym.st_info = ELF64_ST_INFO( STB_GLOBAL, STT_OBJECT );
+        sym.st_other = STV_DEFAULT;
+        sym.st_shndx = SO_RODATA;
+        p = encodeSym( p, &sym );
+
+        h = elfHash( it->symbol ) % nsyms;
+        chains[ i ] = buckets[ h ];
+        buckets[ h ] = i++;
+    }
+
+    p = meta + hashOffset;
+    p = hashEntrySize == 8 ? put64( p, nsyms ) : put32( p, nsyms );
+    p = hashEntrySize == 8 ? put64( p, nsyms ) : put32( p, nsyms );
+    for ( i = 0; i < 2 * nsyms; ++i )
+        p = hashEntrySize == 8 ? put64( p, buckets[ i ] ) : put32( p, buckets[ i ] );
+    free( buckets );
+
+    p = meta + dynstrOffset;
+    *p++ = '\0';
+    memcpy( p, soname, sonameSize );
+    memcpy( p + sonameSize, strtab + 1, strtabSize - 1 );
+    free( strtab );
+    memcpy( meta + shstrtabOffset, soShstrtabData, sizeof( soShstrtabData ) );
+
+    dynamic[ 0 ][ 0 ] = DT_SONAME;
+    dynamic[ 0 ][ 1 ] = 1;
+    dynamic[ 1 ][ 0 ] = DT_HASH;
+    dynamic[ 1 ][ 1 ] = hashOffset;
+    dynamic[ 2 ][ 0 ] = DT_STRTAB;
+    dynamic[ 2 ][ 1 ] = dynstrOffset;
+    dynamic[ 3 ][ 0 ] = DT_SYMTAB;
+    dynamic[ 3 ][ 1 ] = dynsymOffset;
+    dynamic[ 4 ][ 0 ] = DT_STRSZ;
+    dynamic[ 4 ][ 1 ] = dynstrSize;
+    dynamic[ 5 ][ 0 ] = DT_SYMENT;
+    dynamic[ 5 ][ 1 ] = symSize();
+    dynamic[ 6 ][ 0 ] = DT_NULL;
+    dynamic[ 6 ][ 1 ] = 0;
+    p = meta + dynamicOffset;
+    for ( i = 0; i < SO_DYNAMICCOUNT; ++i ) {
+        p = putWord( p, dynamic[ i ][ 0 ] );
+        p = putWord( p, dynamic[ i ][ 1 ] );
+    }
+
+    memset( phdrs, 0, sizeof( phdrs ) );
+    phdrs[ 0 ].p_type = PT_LOAD;
+    phdrs[ 0 ].p_flags = PF_R;
+    phdrs[ 0 ].p_filesz = phdrs[ 0 ].p_memsz = dynstrOffset + dynstrSize;
+    phdrs[ 0 ].p_align = align;
+    phdrs[ 1 ].p_type = PT_LOAD;
+    phdrs[ 1 ].p_flags = PF_R | PF_W;
+    phdrs[ 1 ].p_offset = dynamicOffset;
+    phdrs[ 1 ].p_vaddr = phdrs[ 1 ].p_paddr = dynamicOffset + shift;
+    phdrs[ 1 ].p_filesz = phdrs[ 1 ].p_memsz = dynamicSize;
+    phdrs[ 1 ].p_align = align;
+    phdrs[ 2 ].p_type = PT_LOAD;
+    phdrs[ 2 ].p_flags = PF_R;
+    phdrs[ 2 ].p_offset = rodataOffset;
+    phdrs[ 2 ].p_vaddr = phdrs[ 2 ].p_paddr = rodataOffset + shift;
+    phdrs[ 2 ].p_filesz = phdrs[ 2 ].p_memsz = payloadSize;
+    phdrs[ 2 ].p_align = align;
+    phdrs[ 3 ] = phdrs[ 1 ];
+    phdrs[ 3 ].p_type = PT_DYNAMIC;
+    phdrs[ 3 ].p_align = wordSize();
+    /* Without this, loading the object would make the stack executable. */
+    phdrs[ 4 ].p_type = PT_GNU_STACK;
+    phdrs[ 4 ].p_flags = PF_R | PF_W;
+    phdrs[ 4 ].p_align = 16;
+
+    memset( shdrs, 0, sizeof( shdrs ) );
+    for ( i = 0; i < SO_SECTIONCOUNT; ++i )
+        shdrs[ i ].sh_name = soSectionNames[ i ];
+    shdrs[ SO_HASH ].sh_type = SHT_HASH;
+    shdrs[ SO_HASH ].sh_flags = SHF_ALLOC;
+    shdrs[ SO_HASH ].sh_addr = shdrs[ SO_HASH ].sh_offset = hashOffset;
+    shdrs[ SO_HASH ].sh_size = hashEntrySize * ( 2 + 2 * nsyms );
+    shdrs[ SO_HASH ].sh_link = SO_DYNSYM;
+    shdrs[ SO_HASH ].sh_addralign = shdrs[ SO_HASH ].sh_entsize = hashEntrySize;
+    shdrs[ SO_DYNSYM ].sh_type = SHT_DYNSYM;
+    shdrs[ SO_DYNSYM ].sh_flags = SHF_ALLOC;
+    shdrs[ SO_DYNSYM ].sh_addr = shdrs[ SO_DYNSYM ].sh_offset = dynsymOffset;
+    shdrs[ SO_DYNSYM ].sh_size = symSize() * nsyms;
+    shdrs[ SO_DYNSYM ].sh_link = SO_DYNSTR;
+    shdrs[ SO_DYNSYM ].sh_info = 1;
+    shdrs[ SO_DYNSYM ].sh_addralign = wordSize();
+    shdrs[ SO_DYNSYM ].sh_entsize = symSize();
+    shdrs[ SO_DYNSTR ].sh_type = SHT_STRTAB;
+    shdrs[ SO_DYNSTR ].sh_flags = SHF_ALLOC;
+    shdrs[ SO_DYNSTR ].sh_addr = shdrs[ SO_DYNSTR ].sh_offset = dynstrOffset;
+    shdrs[ SO_DYNSTR ].sh_size = dynstrSize;
+    shdrs[ SO_DYNSTR ].sh_addralign = 1;
+    shdrs[ SO_DYNAMIC ].sh_type = SHT_DYNAMIC;
+    shdrs[ SO_DYNAMIC ].sh_flags = SHF_ALLOC | SHF_WRITE;
+    shdrs[ SO_DYNAMIC ].sh_addr = dynamicOffset + shift;
+    shdrs[ SO_DYNAMIC ].sh_offset = dynamicOffset;
+    shdrs[ SO_DYNAMIC ].sh_size = dynamicSize;
+    shdrs[ SO_DYNAMIC ].sh_link = SO_DYNSTR;
+    shdrs[ SO_DYNAMIC ].sh_addralign = wordSize();
+    shdrs[ SO_DYNAMIC ].sh_entsize = 2 * wordSize();
+    shdrs[ SO_RODATA ].sh_type = SHT_PROGBITS;
+    shdrs[ SO_RODATA ].sh_flags = SHF_ALLOC;
+    shdrs[ SO_RODATA ].sh_addr = rodataOffset + shift;
+    shdrs[ SO_RODATA ].sh_offset = rodataOffset;
+    shdrs[ SO_RODATA ].sh_size = payloadSize;
+    shdrs[ SO_RODATA ].sh_addralign = rodataHeader.sh_addralign;
+    shdrs[ SO_SHSTRTAB ].sh_type = SHT_STRTAB;
+    shdrs[ SO_SHSTRTAB ].sh_offset = shstrtabOffset;
+    shdrs[ SO_SHSTRTAB ].sh_size = sizeof( soShstrtabData );
+    shdrs[ SO_SHSTRTAB ].sh_addralign = 1;
+
+    ehdr.e_type = ET_DYN;
+    ehdr.e_phoff = ehdrSize();
+    ehdr.e_phentsize = phdrSize();
+    ehdr.e_phnum = SO_SEGMENTCOUNT;
+    ehdr.e_shoff = shdrOffset;
+    ehdr.e_shnum = SO_SECTIONCOUNT;
+    ehdr.e_shstrndx = SO_SHSTRTAB;
+
+    p = encodeEhdr( meta, &ehdr );
+    for ( i = 0; i < SO_SEGMENTCOUNT; ++i )
+        p = encodePhdr( p, &phdrs[ i ] );
+    p = meta + shdrOffset;
+    for ( i = 0; i < SO_SECTIONCOUNT; ++i )
+        p = encodeShdr( p, &shdrs[ i ] );
+
+    if ( ( fd = createOutput( fn, 0644, &tmp ) ) == -1 ) {
+        free( meta );
+        return -1;
+    }
+    if ( writeBuffer( fd, (const char *)meta, dynamicOffset + dynamicSize, NULL ) == -1 ||
+         skipTo( fd, dynamicOffset + dynamicSize, rodataOffset ) == -1 ) {
+        fprintf( stderr, "Failed to write headers to %s: %s\n", fn, strerror( errno ) );
+        free( meta );
+        discardOutput( fd, tmp );
+        return -1;
+    }
+    free( meta );
+    endPhase( &mark, "write.headers" );
+
+    markPhase( &mark );
+    if ( writeFiles( fd ) == -1 ) {
+        discardOutput( fd, tmp );
+        return -1;
+    }
+    endPhase( &mark, "write.payload" );
+
+    return commitOutput( fd, tmp, fn );
+}
+
+/* Tells whether 'pattern' is usable as a printf() format for the
+ * names of the object files, i.e. has exactly one %d in it. */
+static int validObjectPattern( const char *pattern )
+{
+    int count = 0;
+
+    for ( ; *pattern; ++pattern ) {
+        if ( *pattern != '%' )
+            continue;
+        if ( pattern[1] == '%' )
+            ++pattern;
+        else if ( pattern[1] == 'd' ) {
+            ++pattern;
+            ++count;
+        } else
+            return 0;
+    }
+
+    return count == 1;
+}
+
+struct ShardItem {
+    struct Resource *res;
+    unsigned long long weight;
+};
+
+static int compareWeightDescending( const void *a, const void *b )
+{
+    const struct ShardItem *l = (const struct ShardItem *)a;
+    const struct ShardItem *r = (const struct ShardItem *)b;
+
+    if ( l->weight != r->weight )
+        return l->weight < r->weight ? 1 : -1;
+    return 0;
+}
+
+/* Distributes the resources over as few object files as possible such
+ * that none of them grows beyond maxObjectSize (unless a single resource
+ * is larger than that already), using first fit decreasing. Duplicates
+ * always go into the object file of their original. Returns the number
+ * of object files (at least one), or 0 on error.
+ */
+static unsigned int assignShards()
+{
+    const unsigned long long overhead = ehdrSize() + shdrSize() * SECTIONHEADERCOUNT +
+                                        sizeof( commentData ) + sizeof( shstrtabData ) +
+                                        LOCALSYMBOLCOUNT * symSize() + 1;
+    struct ShardItem *items;
+    unsigned long long *used;
+    struct Resource *it;
+    unsigned int count = 0, nshards = 0, i, k;
+
+    for ( it = resources; it != 0; it = it->next )
+        if ( !it->alias )
+            ++count;
+
+    if ( ( items = (struct ShardItem *)malloc( count * sizeof( *items ) + 1 ) ) == NULL ||
+         ( used = (unsigned long long *)malloc( count * sizeof( *used ) + 1 ) ) == NULL ) {
+        fprintf( stderr, "Failed to allocate memory: %s\n", strerror( errno ) );
+        free( items );
+        return 0;
+    }
+
+    /* Until the real shard is known, 'shard' is the index of the
+     * original's item so that duplicates can add their symbol to it. */
+    count = 0;
+    for ( it = resources; it != 0; it = it->next ) {
+        if ( it->alias ) {
+            items[ it->alias->shard ].weight += symSize() + it->symbolSize;
+            continue;
+        }
+        it->shard = count;
+        items[ count ].res = it;
+        items[ count++ ].weight = ( zeroFilled( it ) ? 0 : it->size + alignment( it ) - 1 ) +
+                                  symSize() + it->symbolSize;
+    }
+    qsort( items, count, sizeof( *items ), compareWeightDescending );
+
+    for ( i = 0; i < count; ++i ) {
+        for ( k = 0; k < nshards; ++k )
+            if ( used[ k ] + items[ i ].weight <= maxObjectSize )
+                break;
+        if ( k == nshards ) {
+            used[ nshards++ ] = overhead;
+            if ( overhead + items[ i ].weight > maxObjectSize )
+                fprintf( stderr, "Warning: %s alone exceeds the maximum object size\n",
+                         items[ i ].res->filename );
+        }
+        used[ k ] += items[ i ].weight;
+        items[ i ].res->shard = k;
+    }
+
+    for ( it = resources; it != 0; it = it->next )
+        if ( it->alias )
+            it->shard = it->alias->shard;
+
+    free( items );
+    free( used );
+
+    /* Without any resources, there's still one (empty) object file. */
+    return nshards > 0 ? nshards : 1;
+}
+
+/* Writes one object file per shard, named after 'pattern'. */
+static int writeShardedRelocatables( const char *pattern, unsigned int nshards )
+{
+    struct Resource **order, **heads, **tails, *it;
+    char fn[ PATH_MAX ];
+    size_t count = 0, i;
+    unsigned int k;
+    int result = 0;
+
+    for ( it = resources; it != 0; it = it->next )
+        ++count;
+
+    order = (struct Resource **)malloc( count * sizeof( *order ) + 1 );
+    heads = (struct Resource **)calloc( nshards, sizeof( *heads ) );
+    tails = (struct Resource **)calloc( nshards, sizeof( *tails ) );
+    if ( !order || !heads || !tails ) {
+        fprintf( stderr, "Failed to allocate memory: %s\n", strerror( errno ) );
+        free( order );
+        free( heads );
+        free( tails );
+        return -1;
+    }
+
+    /* Split the resource list into one list per shard, keeping the
+     * original order within each of them. */
+    count = 0;
+    for ( it = resources; it != 0; it = it->next )
+        order[ count++ ] = it;
+    for ( i = 0; i < count; ++i ) {
+        it = order[ i ];
+        it->next = 0;
+        if ( tails[ it->shard ] )
+            tails[ it->shard ]->next = it;
+        else
+            heads[ it->shard ] = it;
+        tails[ it->shard ] = it;
+    }
+
+    for ( k = 0; k < nshards && result == 0; ++k ) {
+        snprintf( fn, sizeof( fn ), pattern, k );
+        resources = heads[ k ];
+        if ( patchHeaders() == -1 || writeELFRelocatable( fn ) == -1 )
+            result = -1;
+    }
+
+    /* Put the complete list back together. */
+    for ( i = 0; i + 1 < count; ++i )
+        order[ i ]->next = order[ i + 1 ];
+    resources = count > 0 ? order[ 0 ] : 0;
+
+    free( order );
+    free( heads );
+    free( tails );
+    return result;
+}
+
+/* A simple bump allocator; everything allocated from an arena is
+ * released at once by arenaRelease(). */
+struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t used;
+    size_t size;
+    union {
+        char data[ 1 ];
+        long double alignment;
+    } u;
+};
+
+struct Arena {
+    struct ArenaChunk *chunks;
+};
+
+static void *arenaAlloc( struct Arena *arena, size_t size )
+{
+    struct ArenaChunk *chunk = arena->chunks;
+    size_t chunkSize;
+    void *p;
+
+    /* Keep everything aligned suitably for any type. */
+    size = ( size + sizeof( chunk->u ) - 1 ) & ~( sizeof( chunk->u ) - 1 );
+
+    if ( !chunk || chunk->size - chunk->used < size ) {
+        chunkSize = size > ( 1 << 20 ) ? size : ( 1 << 20 );
+        if ( ( chunk = (struct ArenaChunk *)malloc( sizeof( *chunk ) + chunkSize ) ) == NULL )
+            return NULL;
+        chunk->next = arena->chunks;
+        chunk->used = 0;
+        chunk->size = chunkSize;
+        arena->chunks = chunk;
+    }
+
+    p = chunk->u.data + chunk->used;
+    chunk->used += size;
+    return p;
+}
+
+static char *arenaStrdup( struct Arena *arena, const char *s, size_t len )
+{
+    char *copy;
+
+    if ( ( copy = (char *)arenaAlloc( arena, len + 1 ) ) != NULL ) {
+        memcpy( copy, s, len );
+        copy[ len ] = '\0';
+    }
+    return copy;
+}
+
+static void arenaRelease( struct Arena *arena )
+{
+    struct ArenaChunk *chunk, *next;
+
+    for ( chunk = arena->chunks; chunk != 0; chunk = next ) {
+        next = chunk->next;
+        free( chunk );
+    }
+    arena->chunks = 0;
+}
+
+/* The resource records are allocated back to back in one arena and
+ * their strings in another, so walking the list touches memory mostly
+ * sequentially. New resources are appended at 'lastResource'. */
+static struct Arena resourceArena, stringArena;
+static struct Resource *lastResource = 0;
+
+/* The directories read for 'dir' lines, which the dependency file
+ * lists as well: adding or removing a file changes their mtime. */
+struct ScannedDirectory {
+    char *path;
+    struct ScannedDirectory *next;
+};
+
+static struct ScannedDirectory *scannedDirectories = 0, *lastScannedDirectory = 0;
+
+static int registerResource( int type,
+                             const char *symbol,
+                             const char *fn,
+                             uint64_t filesize,
+                             unsigned int align )
+{
+    struct Resource *res;
+    size_t symbolLen = strlen( symbol );
+
+    if ( ( res = (struct Resource *)arenaAlloc( &resourceArena, sizeof( struct Resource ) ) ) == NULL ||
+         ( res->symbol = arenaStrdup( &stringArena, symbol, symbolLen ) ) == NULL ||
+         ( res->filename = arenaStrdup( &stringArena, fn, strlen( fn ) ) ) == NULL ) {
+        fprintf( stderr, "Failed to allocate memory for resource %s: %s\n", symbol, strerror( errno ) );
+        return -1;
+    }
+    res->type = type;
+    res->symbolSize = symbolLen + 1;
+    res->size = filesize;
+    if ( type == TEXT )
+        ++res->size;
+    res->rawSize = res->size;
+    res->device = 0;
+    res->align = align;
+    res->data = 0;
+    res->source = res->filename;
+    res->generated = 0;
+    res->ignore = FALSE;
+    res->alias = 0;
+    res->next = 0;
+
+    if ( !resources )
+        resources = res;
+    else
+        lastResource->next = res;
+    lastResource = res;
+
+    if ( verbosity > 0 )
+        printf( "Registered resurce %s (type %d) => %s (%llu bytes)\n",
+                symbol, type, fn, (unsigned long long)filesize );
+    return 0;
+}
+
+static void freeResourceList()
+{
+    struct Resource *it;
+
+    for ( it = resources; it != 0; it = it->next ) {
+        free( it->data );
+        if ( it->source != it->filename ) {
+            unlink( it->source );
+            free( it->source );
+        }
+    }
+
+    arenaRelease( &resourceArena );
+    arenaRelease( &stringArena );
+    resources = lastResource = 0;
+    scannedDirectories = lastScannedDirectory = 0;
+}
+
+static const struct {
+    const char *name;
+    int type;
+} resourceTypes[] = {
+    { "text", TEXT },
+    { "binary", BINARY },
+#if defined(HAVE_ZSTD) || !defined(HAVE_LZ4)
+    { "compressed", ZSTD },
+#else
+    { "compressed", LZ4 },
+#endif
+    { "compressed:zstd", ZSTD },
+    { "compressed:lz4", LZ4 },
+    { "dir", DIRECTORY },
+    { "zero", ZERO },
+    { "zero-ro", ZERORO }
+};
+
+/* Maps the type name used in resource files to a resource type,
+ * returns -1 for unknown names. */
+static int resourceType( const char *name )
+{
+    unsigned int i;
+
+    for ( i = 0; i < sizeof( resourceTypes ) / sizeof( resourceTypes[0] ); ++i )
+        if ( strcmp( name, resourceTypes[ i ].name ) == 0 )
+            return resourceTypes[ i ].type;
+    return -1;
+}
+
+/* Tells whether this elfrc binary can produce resources of 'type'. */
+static int typeSupported( int type )
+{
+    switch ( type ) {
+#ifndef HAVE_ZSTD
+    case ZSTD:
+        return 0;
+#endif
+#ifndef HAVE_LZ4
+    case LZ4:
+        return 0;
+#endif
+    default:
+        return 1;
+    }
+}
+
+/* With --server, elfrc keeps running and compiles on behalf of clients
+ * (see serve()). Each request is handled by a process of its own which
+ * inherits what the server knows about the input files so far, i.e.
+ * their status and maybe the hash of their contents. Whatever else it
+ * finds out is sent back to the server as a CacheRecord datagram on
+ * 'cacheSocket', and the server watches those files with inotify to
+ * forget about them as soon as they change. */
+struct CacheEntry {
+    char *path;
+    struct stat sb;
+    uint64_t hash;
+    int hashed;
+    struct CacheEntry *next;
+    struct CacheEntry *nextWatched;
+};
+
+struct CacheRecord {
+    struct stat sb;
+    uint64_t hash;
+    int hashed;
+    char path[ PATH_MAX ];
+};
+
+#define CACHE_BUCKETS 65536
+
+static struct CacheEntry *cache[ CACHE_BUCKETS ];
+static const char *cacheDirectory = 0;
+static int cacheSocket = -1;
+
+static unsigned int cacheBucket( const char *path )
+{
+    struct Hash h;
+
+    hashInit( &h, 0 );
+    hashUpdate( &h, path, strlen( path ) );
+    return hashFinal( &h ) % CACHE_BUCKETS;
+}
+
+/* Stores the absolute path the cache knows 'fn' by in 'rec' and
+ * returns its length, or -1 if it's too long. */
+static int cacheKey( const char *fn, struct CacheRecord *rec )
+{
+    int len;
+
+    if ( fn[ 0 ] == '/' )
+        len = snprintf( rec->path, sizeof( rec->path ), "%s", fn );
+    else
+        len = snprintf( rec->path, sizeof( rec->path ), "%s/%s", cacheDirectory, fn );
+    return len >= 0 && len < (int)sizeof( rec->path ) ? len : -1;
+}
+
+static struct CacheEntry *cacheFind( const char *path )
+{
+    struct CacheEntry *e;
+
+    for ( e = cache[ cacheBucket( path ) ]; e != 0; e = e->next )
+        if ( strcmp( e->path, path ) == 0 )
+            return e;
+    return 0;
+}
+
+/* Tells the server about the file in 'rec'; it's just a hint, so
+ * errors don't matter. */
+static void cacheSend( const struct CacheRecord *rec, int len )
+{
+    send( cacheSocket, rec, offsetof( struct CacheRecord, path ) + len, 0 );
+}
+
+/* Like stat(), but answered from the server's cache if possible. */
+static int statFile( const char *fn, struct stat *sb )
+{
+    struct CacheRecord rec;
+    struct CacheEntry *e;
+    int len;
+
+    if ( cacheSocket == -1 || ( len = cacheKey( fn, &rec ) ) == -1 )
+        return stat( fn, sb );
+
+    if ( ( e = cacheFind( rec.path ) ) != 0 ) {
+        *sb = e->sb;
+        return 0;
+    }
+    if ( stat( fn, sb ) == -1 )
+        return -1;
+
+    /* Streams need to be read every time. */
+    if ( S_ISREG( sb->st_mode ) && sb->st_size > 0 ) {
+        rec.sb = *sb;
+        rec.hash = 0;
+        rec.hashed = 0;
+        cacheSend( &rec, len );
+    }
+    return 0;
+}
+
+/* State of parsing one resource file. Everything lives in here, so
+ * several resource files can be parsed at the same time. */
+struct ResourceFileParser {
+    unsigned int lineno;
+    char type[ 32 ];
+    char symbol[ 256 ];
+    char filename[ PATH_MAX ];
+    char alignment[ 16 ];
+};
+
+/* A file found while scanning a 'dir' resource. */
+struct DirectoryFile {
+    char *path;
+    char *symbol;
+    uint64_t size;
+    dev_t device;
+    int error;
+    int regular;
+};
+
+struct DirectoryScan {
+    struct Arena strings;
+    struct DirectoryFile *files;
+    size_t count;
+    size_t capacity;
+    const char *prefix;
+    size_t rootLen;
+
+    /* Used by the stat workers. */
+    pthread_mutex_t lock;
+    size_t next;
+};
+
+/* Mangles the path 'rel' (relative to the scanned directory) into a
+ * symbol name: the prefix, an underscore and the path with every
+ * character that can't be part of a C identifier replaced by '_'.
+ * 'images/logo.png' in 'dir<TAB>res<TAB>...' becomes res_images_logo_png. */
+static char *mangleSymbol( struct DirectoryScan *scan, const char *rel )
+{
+    size_t prefixLen = strlen( scan->prefix ), len = strlen( rel ), i;
+    char *symbol;
+
+    if ( ( symbol = (char *)arenaAlloc( &scan->strings, prefixLen + len + 2 ) ) == NULL )
+        return NULL;
+    memcpy( symbol, scan->prefix, prefixLen );
+    symbol[ prefixLen ] = '_';
+    for ( i = 0; i < len; ++i ) {
+        char c = rel[ i ];
+        symbol[ prefixLen + 1 + i ] = ( ( c >= 'a' && c <= 'z' ) || ( c >= 'A' && c <= 'Z' ) ||
+                                        ( c >= '0' && c <= '9' ) ) ? c : '_';
+    }
+    symbol[ prefixLen + 1 + len ] = '\0';
+    return symbol;
+}
+
+static int addDirectoryFile( struct DirectoryScan *scan, const char *path, int regular )
+{
+    struct DirectoryFile *file;
+
+    if ( scan->count == scan->capacity ) {
+        size_t capacity = scan->capacity ? scan->capacity * 2 : 256;
+        if ( ( file = (struct DirectoryFile *)realloc( scan->files, capacity * sizeof( *file ) ) ) == NULL )
+            return -1;
+        scan->files = file;
+        scan->capacity = capacity;
+    }
+
+    file = &scan->files[ scan->count ];
+    if ( ( file->path = arenaStrdup( &scan->strings, path, strlen( path ) ) ) == NULL ||
+         ( file->symbol = mangleSymbol( scan, path + scan->rootLen + 1 ) ) == NULL )
+        return -1;
+    file->size = 0;
+    file->error = 0;
+    file->regular = regular;
+    ++scan->count;
+    return 0;
+}
+
+/* Remembers the directory 'path' for the dependency file. */
+static int addScannedDirectory( const char *path, size_t len )
+{
+    struct ScannedDirectory *dir;
+
+    if ( ( dir = (struct ScannedDirectory *)arenaAlloc( &stringArena, sizeof( *dir ) ) ) == NULL ||
+         ( dir->path = arenaStrdup( &stringArena, path, len ) ) == NULL )
+        return -1;
+    dir->next = 0;
+    if ( !scannedDirectories )
+        scannedDirectories = dir;
+    else
+        lastScannedDirectory->next = dir;
+    lastScannedDirectory = dir;
+    return 0;
+}
+
+/* Collects the names of all files below 'path' (which is modified but
+ * restored before returning). Only the directory entries are read
+ * here; symbolic links and entries of unknown type are stat()ed later
+ * along with everything else. Directories behind symbolic links are
+ * not followed, which keeps loops out. */
+static int scanDirectory( struct DirectoryScan *scan, char *path, size_t len )
+{
+    struct dirent *entry;
+    struct stat sb;
+    DIR *dir;
+    size_t nameLen;
+    int result = 0, isDir;
+
+    if ( ( dir = opendir( path ) ) == NULL ) {
+        fprintf( stderr, "Failed to read directory %s: %s\n", path, strerror( errno ) );
+        return -1;
+    }
+    if ( addScannedDirectory( path, len ) == -1 ) {
+        fprintf( stderr, "Failed to allocate directory listing: %s\n", strerror( errno ) );
+        closedir( dir );
+        return -1;
+    }
+
+    while ( result == 0 && ( entry = readdir( dir ) ) != NULL ) {
+        if ( strcmp( entry->d_name, "." ) == 0 || strcmp( entry->d_name, ".." ) == 0 )
+            continue;
+
+        nameLen = strlen( entry->d_name );
+        if ( len + nameLen + 2 > PATH_MAX ) {
+            fprintf( stderr, "Path %s/%s is too long\n", path, entry->d_name );
+            result = -1;
+            break;
+        }
+        path[ len ] = '/';
+        memcpy( path + len + 1, entry->d_name, nameLen + 1 );
+
+        isDir = entry->d_type == DT_DIR;
+        if ( entry->d_type == DT_UNKNOWN ) {
+            if ( lstat( path, &sb ) == -1 ) {
+                fprintf( stderr, "Failed to access %s: %s\n", path, strerror( errno ) );
+                result = -1;
+                break;
+            }
+            isDir = S_ISDIR( sb.st_mode );
+        }
+
+        if ( isDir )
+            result = scanDirectory( scan, path, len + 1 + nameLen );
+        else if ( addDirectoryFile( scan, path, entry->d_type == DT_REG ) == -1 ) {
+            fprintf( stderr, "Failed to allocate directory listing: %s\n", strerror( errno ) );
+            result = -1;
+        }
+    }
+
+    path[ len ] = '\0';
+    closedir( dir );
+    return result;
+}
+
+/* Looks up the sizes of the files found by scanDirectory(); several
+ * of these run at once, since on network file systems most of the
+ * time is spent waiting for the server. */
+static void *statWorker( void *arg )
+{
+    struct DirectoryScan *scan = (struct DirectoryScan *)arg;
+    struct DirectoryFile *file;
+    struct stat sb;
+    size_t i;
+
+    for ( ;; ) {
+        pthread_mutex_lock( &scan->lock );
+        i = scan->next < scan->count ? scan->next++ : scan->count;
+        pthread_mutex_unlock( &scan->lock );
+        if ( i == scan->count )
+            break;
+
+        file = &scan->files[ i ];
+        if ( statFile( file->path, &sb ) == -1 ) {
+            file->error = errno;
+        } else {
+            file->size = sb.st_size;
+            file->device = sb.st_dev;
+            file->regular = S_ISREG( sb.st_mode );
+        }
+    }
+
+    return 0;
+}
+
+static int compareDirectoryFile( const void *a, const void *b )
+{
+    return strcmp( ( (const struct DirectoryFile *)a )->symbol,
+                   ( (const struct DirectoryFile *)b )->symbol );
+}
+
+/* Registers every file below the directory of a 'dir' line as a
+ * 'binary' resource, sorted by symbol name so that the output does
+ * not depend on the order of the directory entries. */
+static int registerDirectory( const struct ResourceFileParser *parser, unsigned int align )
+{
+    struct DirectoryScan scan;
+    char path[ PATH_MAX ];
+    size_t i;
+    int result = 0;
+
+    memset( &scan, 0, sizeof( scan ) );
+    scan.prefix = parser->symbol;
+    scan.rootLen = strlen( parser->filename );
+    while ( scan.rootLen > 1 && parser->filename[ scan.rootLen - 1 ] == '/' )
+        --scan.rootLen;
+    memcpy( path, parser->filename, scan.rootLen );
+    path[ scan.rootLen ] = '\0';
+
+    if ( scanDirectory( &scan, path, scan.rootLen ) == -1 ) {
+        fprintf( stderr, "Error in line %d of resource file: failed to scan %s\n",
+                 parser->lineno, parser->filename );
+        result = -1;
+        goto out;
+    }
+
+    pthread_mutex_init( &scan.lock, NULL );
+    runWorkers( statWorker, &scan, scan.count );
+    pthread_mutex_destroy( &scan.lock );
+
+    qsort( scan.files, scan.count, sizeof( *scan.files ), compareDirectoryFile );
+    for ( i = 0; i < scan.count && result == 0; ++i ) {
+        struct DirectoryFile *file = &scan.files[ i ];
+
+        if ( file->error ) {
+            fprintf( stderr, "Error in line %d of resource file: failed to access %s: %s\n",
+                     parser->lineno, file->path, strerror( file->error ) );
+            result = -1;
+        } else if ( i > 0 && strcmp( file->symbol, scan.files[ i - 1 ].symbol ) == 0 ) {
+            fprintf( stderr, "Error in line %d of resource file: %s and %s both map to symbol %s\n",
+                     parser->lineno, scan.files[ i - 1 ].path, file->path, file->symbol );
+            result = -1;
+        } else if ( !file->regular ) {
+            if ( verbosity > 0 )
+                printf( "Skipping %s, which is not a regular file\n", file->path );
+        } else {
+            if ( ( result = registerResource( BINARY, file->symbol, file->path, file->size, align ) ) == 0 )
+                lastResource->device = file->device;
+        }
+    }
+
+out:
+    free( scan.files );
+    arenaRelease( &scan.strings );
+    return result;
+}
+
+/* Streams larger than this are spilled to a temporary file rather
+ * than kept in memory. */
+#define STREAM_MEMORY_LIMIT ( 64 << 20 )
+
+/* Drains the pipe, FIFO or other file of unknown size 'fn' into
+ * the just registered resource 'res' and fixes up its size. */
+static int readStream( struct Resource *res, const char *fn )
+{
+    size_t capacity = 65536, size = 0;
+    char *data, *grown, *tmpdir, *spill = 0;
+    ssize_t nread;
+    int fd, out = -1;
+
+    if ( ( fd = open( fn, O_RDONLY ) ) == -1 ) {
+        fprintf( stderr, "Failed to open %s for reading: %s\n", fn, strerror( errno ) );
+        return -1;
+    }
+    if ( ( data = (char *)malloc( capacity ) ) == NULL ) {
+        fprintf( stderr, "Failed to allocate memory for %s: %s\n", fn, strerror( errno ) );
+        close( fd );
+        return -1;
+    }
+
+    for ( ;; ) {
+        if ( out == -1 && size == capacity ) {
+            if ( capacity < STREAM_MEMORY_LIMIT ) {
+                if ( ( grown = (char *)realloc( data, capacity * 2 ) ) == NULL ) {
+                    fprintf( stderr, "Failed to allocate memory for %s: %s\n", fn, strerror( errno ) );
+                    goto fail;
+                }
+                data = grown;
+                capacity *= 2;
+            } else {
+                if ( ( tmpdir = getenv( "TMPDIR" ) ) == NULL )
+                    tmpdir = "/tmp";
+                if ( ( spill = (char *)malloc( strlen( tmpdir ) + 14 ) ) == NULL ) {
+                    fprintf( stderr, "Failed to allocate memory for %s: %s\n", fn, strerror( errno ) );
+                    goto fail;
+                }
+                sprintf( spill, "%s/elfrc-XXXXXX", tmpdir );
+                if ( ( out = mkstemp( spill ) ) == -1 ) {
+                    fprintf( stderr, "Failed to create temporary file for %s: %s\n", fn, strerror( errno ) );
+                    goto fail;
+                }
+                if ( verbosity > 0 )
+                    printf( "Spilling %s to %s\n", fn, spill );
+                if ( writeBuffer( out, data, size, NULL ) == -1 )
+                    goto writeError;
+            }
+        }
+
+        if ( out == -1 )
+            nread = read( fd, data + size, capacity - size );
+        else
+            nread = read( fd, data, capacity );
+        if ( nread == -1 ) {
+            if ( errno == EINTR )
+                continue;
+            fprintf( stderr, "Failed to read from %s: %s\n", fn, strerror( errno ) );
+            goto fail;
+        }
+        if ( nread == 0 )
+            break;
+        if ( out != -1 && writeBuffer( out, data, nread, NULL ) == -1 )
+            goto writeError;
+        size += nread;
+    }
+    close( fd );
+
+    res->size = res->rawSize = res->type == TEXT ? size + 1 : size;
+    if ( out != -1 ) {
+        free( data );
+        if ( close( out ) == -1 ) {
+            fprintf( stderr, "Failed to write %s: %s\n", spill, strerror( errno ) );
+            unlink( spill );
+            free( spill );
+            return -1;
+        }
+        res->source = spill;
+    } else {
+        /* The buffer is grown before it's full, so there's always
+         * room for the trailing zero of 'text' resources. */
+        data[ size ] = '\0';
+        res->data = data;
+    }
+
+    if ( verbosity > 0 )
+        printf( "Read %llu bytes from %s\n", (unsigned long long)size, fn );
+    return 0;
+
+writeError:
+    fprintf( stderr, "Failed to write %s: %s\n", spill, strerror( errno ) );
+fail:
+    if ( out != -1 ) {
+        close( out );
+        unlink( spill );
+    }
+    free( spill );
+    free( data );
+    close( fd );
+    return -1;
+}
+
+/* Parses a size like '4096', '64K', '16M' or '2G' into '*size'. */
+static int parseSize( const char *s, unsigned long long *size )
+{
+    char *end;
+
+    *size = strtoull( s, &end, 0 );
+    switch ( *end ) {
+    case 'k': case 'K': *size <<= 10; ++end; break;
+    case 'm': case 'M': *size <<= 20; ++end; break;
+    case 'g': case 'G': *size <<= 30; ++end; break;
+    }
+    return end == s || *end ? -1 : 0;
+}
+
+/* Registers the resource described by a completely parsed line. */
+static int registerLine( const struct ResourceFileParser *parser )
+{
+    struct stat sb;
+    char *end;
+    unsigned long align = 0;
+    unsigned long long size;
+
+    /* Resources aligned to pages get pages of their own, see
+     * patchHeaders(). */
+    if ( strcmp( parser->alignment, "page" ) == 0 ) {
+        align = target->pageSize;
+    } else if ( strcmp( parser->alignment, "hugepage" ) == 0 ) {
+        align = HUGEPAGESIZE;
+    } else if ( parser->alignment[ 0 ] ) {
+        align = strtoul( parser->alignment, &end, 0 );
+        if ( *end || align == 0 || ( align & ( align - 1 ) ) != 0 ) {
+            fprintf( stderr, "Error in line %d of resource file: alignment '%s' is not a power of two\n",
+                     parser->lineno, parser->alignment );
+            return -1;
+        }
+    }
+
+    if ( resourceType( parser->type ) == DIRECTORY )
+        return registerDirectory( parser, align );
+
+    /* 'zero' and 'zero-ro' lines give a size instead of a file. */
+    if ( resourceType( parser->type ) == ZERO || resourceType( parser->type ) == ZERORO ) {
+        if ( parseSize( parser->filename, &size ) == -1 ) {
+            fprintf( stderr, "Error in line %d of resource file: invalid size '%s'\n",
+                     parser->lineno, parser->filename );
+            return -1;
+        }
+        if ( registerResource( resourceType( parser->type ), parser->symbol, parser->filename,
+                               size, align ) == -1 )
+            return -1;
+        lastResource->generated = 1;
+        return 0;
+    }
+
+    if ( statFile( parser->filename, &sb ) == -1 ) {
+        fprintf( stderr, "Error in line %d of resource file: failed to access %s: %s\n",
+                 parser->lineno, parser->filename, strerror( errno ) );
+        return -1;
+    }
+
+    if ( registerResource( resourceType( parser->type ), parser->symbol, parser->filename,
+                           sb.st_size, align ) == -1 )
+        return -1;
+    lastResource->device = sb.st_dev;
+
+    /* Pipes, FIFOs and the like (and files such as those in /proc,
+     * which claim to be empty) only tell their size once read. */
+    if ( ( !S_ISREG( sb.st_mode ) || sb.st_size == 0 ) && !S_ISDIR( sb.st_mode ) &&
+         readStream( lastResource, parser->filename ) == -1 ) {
+        fprintf( stderr, "Error in line %d of resource file: failed to read %s\n",
+                 parser->lineno, parser->filename );
+        return -1;
+    }
+    return 0;
+}
+
+/* Copies the field [begin, end) to the 'size' bytes at 'field'. */
+static int copyField( const struct ResourceFileParser *parser, const char *what,
+                      char *field, size_t size, const char *begin, const char *end )
+{
+    size_t len = end - begin;
+
+    if ( len >= size ) {
+        memcpy( field, begin, size - 1 );
+        field[ size - 1 ] = '\0';
+        fprintf( stderr,
+                 "Error in line %d of resource file: %s '%s' is too long\n",
+                 parser->lineno, what, field );
+        return -1;
+    }
+
+    memcpy( field, begin, len );
+    field[ len ] = '\0';
+    return 0;
+}
+
+/* Parses the line [line, end), which doesn't include the newline. */
+static int parseLine( struct ResourceFileParser *parser, const char *line, const char *end )
+{
+    const char *typeEnd, *symbolEnd, *filenameEnd;
+    int type;
+
+    if ( ( typeEnd = (const char *)memchr( line, '\t', end - line ) ) == NULL ) {
+        fprintf( stderr,
+                 "Error in line %d of resource file: expected tab and symbol name, got newline\n",
+                 parser->lineno );
+        return -1;
+    }
+    if ( copyField( parser, "resource type", parser->type, sizeof( parser->type ),
+                    line, typeEnd ) == -1 )
+        return -1;
+
+    if ( ( type = resourceType( parser->type ) ) == -1 ) {
+        fprintf( stderr,
+                 "Warning: Unknown resource type '%s' in line %d of resource file; assuming 'binary'.\n",
+                 parser->type, parser->lineno  );
+        strncpy( parser->type, "binary", sizeof( parser->type ) );
+    } else if ( !typeSupported( type ) ) {
+        fprintf( stderr,
+                 "Error in line %d of resource file: this elfrc was built without support for '%s' resources\n",
+                 parser->lineno, parser->type );
+        return -1;
+    }
+
+    ++typeEnd;
+    if ( ( symbolEnd = (const char *)memchr( typeEnd, '\t', end - typeEnd ) ) == NULL ) {
+        fprintf( stderr,
+                 "Error in line %d of resource file: expected tab and filename, got newline\n",
+                 parser->lineno );
+        return -1;
+    }
+    if ( copyField( parser, "symbol", parser->symbol, sizeof( parser->symbol ),
+                    typeEnd, symbolEnd ) == -1 )
+        return -1;
+
+    /* The alignment is optional. */
+    ++symbolEnd;
+    if ( ( filenameEnd = (const char *)memchr( symbolEnd, '\t', end - symbolEnd ) ) == NULL ) {
+        filenameEnd = end;
+        parser->alignment[ 0 ] = '\0';
+    } else if ( copyField( parser, "alignment", parser->alignment, sizeof( parser->alignment ),
+                           filenameEnd + 1, end ) == -1 ) {
+        return -1;
+    }
+    if ( copyField( parser, "file name", parser->filename, sizeof( parser->filename ),
+                    symbolEnd, filenameEnd ) == -1 )
+        return -1;
+
+    return registerLine( parser );
+}
+
+/* Parses the complete contents of a resource file. Empty lines are
+ * skipped, and the last line doesn't need to end in a newline. */
+static int parseResourceFileData( struct ResourceFileParser *parser,
+                                  const char *buffer, size_t len )
+{
+    const char *line = buffer, *end = buffer + len, *nl;
+
+    for ( parser->lineno = 1; line < end; line = nl + 1, ++parser->lineno ) {
+        if ( ( nl = (const char *)memchr( line, '\n', end - line ) ) == NULL )
+            nl = end;
+        if ( nl > line && parseLine( parser, line, nl ) == -1 )
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Reads everything from the (possibly unseekable) 'fd' into memory. */
+static char *readAll( int fd, size_t *len )
+{
+    char *buffer = 0, *grown;
+    size_t size = 0;
+    ssize_t nread;
+
+    *len = 0;
+    do {
+        if ( *len == size ) {
+            size = size ? size * 2 : 1 << 20;
+            if ( ( grown = (char *)realloc( buffer, size ) ) == NULL ) {
+                free( buffer );
+                return NULL;
+            }
+            buffer = grown;
+        }
+        if ( ( nread = read( fd, buffer + *len, size - *len ) ) == -1 ) {
+            free( buffer );
+            return NULL;
+        }
+        *len += nread;
+    } while ( nread > 0 );
+
+    return buffer;
+}
+
+static int loadResources( const char *fn )
+{
+    int fd;
+    struct stat sb;
+    struct ResourceFileParser parser;
+    char *buffer;
+    size_t len;
+    int result;
+
+    if ( verbosity > 0 )
+        printf( "Loading resource configuration from %s\n", fn );
+
+    if ( !fn || strcmp( fn, "-" ) == 0 ) {
+        fn = "standard input";
+        fd = STDIN_FILENO;
+    } else if ( ( fd = open( fn, O_RDONLY ) ) == -1 ) {
+        fprintf( stderr, "Failed to open %s for reading: %s\n", fn, strerror( errno ) );
+        return -1;
+    }
+
+    /* Regular files are mapped, everything else is read in big blocks. */
+    if ( fstat( fd, &sb ) == 0 && S_ISREG( sb.st_mode ) && sb.st_size > 0 &&
+         ( buffer = (char *)mmap( 0, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0 ) ) != MAP_FAILED ) {
+        madvise( buffer, sb.st_size, MADV_SEQUENTIAL );
+        result = parseResourceFileData( &parser, buffer, sb.st_size );
+        munmap( buffer, sb.st_size );
+    } else if ( ( buffer = readAll( fd, &len ) ) != NULL ) {
+        result = parseResourceFileData( &parser, buffer, len );
+        free( buffer );
+    } else {
+        fprintf( stderr, "Failed to read from %s: %s\n", fn, strerror( errno ) );
+        result = -1;
+    }
+
+    if ( fd != STDIN_FILENO )
+        close( fd );
+    return result;
+}
+
+/* Computes the hash of the contents of 'fn'. */
+static int hashFile( const char *fn, uint64_t *hash )
+{
+    int fd;
+    char buffer[ 65536 ];
+    ssize_t nread;
+    struct Hash h;
+    struct CacheRecord rec;
+    struct CacheEntry *e;
+    int len = -1;
+
+    if ( cacheSocket != -1 && ( len = cacheKey( fn, &rec ) ) != -1 &&
+         ( e = cacheFind( rec.path ) ) != 0 && e->hashed ) {
+        *hash = e->hash;
+        return 0;
+    }
+
+    if ( ( fd = open( fn, O_RDONLY ) ) == -1 )
+        return -1;
+
+    hashInit( &h, 0 );
+    while ( ( nread = read( fd, buffer, sizeof( buffer ) ) ) > 0 )
+        hashUpdate( &h, buffer, nread );
+    if ( nread != -1 && len != -1 && fstat( fd, &rec.sb ) == 0 ) {
+        rec.hash = hashFinal( &h );
+        rec.hashed = 1;
+        cacheSend( &rec, len );
+    }
+    close( fd );
+    if ( nread == -1 )
+        return -1;
+
+    *hash = hashFinal( &h );
+    return 0;
+}
+
+struct HashedResource {
+    struct Resource *res;
+    uint64_t hash;
+};
+
+/* Orders by type and size first, so that only resources which
+ * could possibly be identical need to be hashed. */
+static int compareTypeAndSize( const void *a, const void *b )
+{
+    const struct HashedResource *l = (const struct HashedResource *)a;
+    const struct HashedResource *r = (const struct HashedResource *)b;
+
+    if ( l->res->type != r->res->type )
+        return l->res->type < r->res->type ? -1 : 1;
+    if ( l->res->size != r->res->size )
+        return l->res->size < r->res->size ? -1 : 1;
+    if ( l->hash != r->hash )
+        return l->hash < r->hash ? -1 : 1;
+    /* Keep the resource file order among identical payloads. */
+    return l->res->payloadOffset < r->res->payloadOffset ? -1 :
+           l->res->payloadOffset > r->res->payloadOffset;
+}
+
+/* Sets the 'alias' field of every resource whose payload is identical
+ * to that of an earlier resource of the same type, so that only one
+ * copy of the data ends up in the object file.
+ */
+static int deduplicateResources()
+{
+    struct HashedResource *items;
+    struct Resource *it;
+    size_t count = 0, i, j, k;
+
+    for ( it = resources; it != 0; it = it->next )
+        ++count;
+
+    if ( ( items = (struct HashedResource *)malloc( count * sizeof( *items ) + 1 ) ) == NULL ) {
+        fprintf( stderr, "Failed to allocate memory: %s\n", strerror( errno ) );
+        return -1;
+    }
+
+    /* payloadOffset isn't computed yet, use it to remember the
+     * original position for the sort. Streams buffered in memory
+     * can't be read again and are left alone, just like zero filled
+     * resources, which have no data at all. */
+    count = 0;
+    for ( it = resources; it != 0; it = it->next ) {
+        if ( it->data || zeroFilled( it ) )
+            continue;
+        it->payloadOffset = count;
+        items[ count ].res = it;
+        items[ count++ ].hash = 0;
+    }
+    qsort( items, count, sizeof( *items ), compareTypeAndSize );
+
+    for ( i = 0; i < count; i = j ) {
+        for ( j = i + 1; j < count &&
+                         items[ j ].res->type == items[ i ].res->type &&
+                         items[ j ].res->size == items[ i ].res->size; ++j )
+            ;
+        if ( j - i < 2 )
+            continue;
+
+        /* Several candidates of the same size; hash them and sort
+         * again so that equal hashes end up next to each other. */
+        for ( k = i; k < j; ++k ) {
+            if ( hashFile( items[ k ].res->source, &items[ k ].hash ) == -1 )
+                items[ k ].hash = k;
+        }
+        qsort( items + i, j - i, sizeof( *items ), compareTypeAndSize );
+
+        for ( k = i + 1; k < j; ++k ) {
+            struct Resource *orig = items[ k - 1 ].res->alias ? items[ k - 1 ].res->alias
+                                                             : items[ k - 1 ].res;
+            if ( items[ k ].hash != items[ k - 1 ].hash ||
+                 !sameContents( orig->source, items[ k ].res->source ) )
+                continue;
+            items[ k ].res->alias = orig;
+            /* Either one may still have its default alignment. */
+            if ( alignment( items[ k ].res ) > alignment( orig ) )
+                orig->align = items[ k ].res->align;
+            if ( verbosity > 0 )
+                printf( "Resource %s has the same contents as %s, sharing them\n",
+                        items[ k ].res->symbol, orig->symbol );
+        }
+    }
+
+    free( items );
+    return 0;
+}
+
+/* Reads all of 'fn' into memory. */
+static char *readFile( const char *fn, size_t size )
+{
+    int fd;
+    char *data;
+    ssize_t nread;
+    size_t off = 0;
+
+    if ( ( fd = open( fn, O_RDONLY ) ) == -1 ) {
+        fprintf( stderr, "Failed to open %s for reading: %s\n", fn, strerror( errno ) );
+        return NULL;
+    }
+    if ( ( data = (char *)malloc( size + 1 ) ) == NULL ) {
+        fprintf( stderr, "Failed to allocate memory for %s: %s\n", fn, strerror( errno ) );
+        close( fd );
+        return NULL;
+    }
+
+    while ( off < size && ( nread = read( fd, data + off, size - off ) ) > 0 )
+        off += nread;
+    close( fd );
+
+    if ( off < size ) {
+        fprintf( stderr, "Failed to read from %s: %s\n", fn,
+                 nread == -1 ? strerror( errno ) : "file got shorter" );
+        free( data );
+        return NULL;
+    }
+
+    return data;
+}
+
+/* The hash function of the lookup table; a seeded FNV-1a with a
+ * final mix step. writeLookupFunction() emits the same code into the
+ * header file. */
+static uint64_t lookupHash( uint64_t seed, const char *key, size_t len )
+{
+    uint64_t h = 0xcbf29ce484222325ULL ^ ( seed * 0x9e3779b97f4a7c15ULL );
+    size_t i;
+
+    for ( i = 0; i < len; ++i ) {
+        h ^= (unsigned char)key[ i ];
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* The lookup table consists of an array of displacements (padded
+ * to a multiple of two entries), one entry per resource and the keys:
+ *
+ *   int32_t displacement[ n + ( n & 1 ) ];
+ *   struct { int64_t offset; uint64_t size; uint32_t key, keylen; } entries[ n ];
+ *   char keys[];
+ *
+ * The offsets are relative to the start of the table, so the table
+ * needs no relocations; that's also why it has to share the section
+ * with all the resources.
+ */
+struct LookupEntry {
+    int64_t offset;
+    uint64_t size;
+    uint32_t key;
+    uint32_t keylen;
+};
+
+static const char *lookupKeyOf( const struct Resource *res )
+{
+    return lookupKey == KeySymbol ? res->symbol : res->filename;
+}
+
+static unsigned int lookupTableCount( unsigned int *keysSize )
+{
+    struct Resource *it;
+    unsigned int n = 0;
+
+    *keysSize = 0;
+    for ( it = resources; it != 0; it = it->next ) {
+        if ( it->generated )
+            continue;
+        ++n;
+        *keysSize += strlen( lookupKeyOf( it ) ) + 1;
+    }
+    return n;
+}
+
+/* Registers the (not yet filled) lookup table as a resource. */
+static int addLookupTable()
+{
+    unsigned int n, keysSize;
+
+    if ( ( n = lookupTableCount( &keysSize ) ) == 0 ) {
+        fprintf( stderr, "There are no resources to put into the lookup table.\n" );
+        return -1;
+    }
+
+    if ( registerResource( BINARY, lookupTable, "lookup table",
+                           sizeof( int32_t ) * ( n + ( n & 1 ) ) +
+                           sizeof( struct LookupEntry ) * n + keysSize, 8 ) == -1 )
+        return -1;
+    lastResource->type = LOOKUPTABLE;
+    lastResource->generated = 1;
+    return 0;
+}
+
+struct LookupKey {
+    const struct Resource *res;
+    const char *key;
+    size_t len;
+    uint64_t bucket;
+};
+
+/* Orders by bucket, then by key, so that duplicate keys always end up
+ * next to each other. */
+static int compareBucket( const void *a, const void *b )
+{
+    const struct LookupKey *l = (const struct LookupKey *)a;
+    const struct LookupKey *r = (const struct LookupKey *)b;
+    int cmp;
+
+    if ( l->bucket != r->bucket )
+        return l->bucket < r->bucket ? -1 : 1;
+    if ( ( cmp = memcmp( l->key, r->key, l->len < r->len ? l->len : r->len ) ) != 0 )
+        return cmp;
+    return l->len < r->len ? -1 : l->len > r->len;
+}
+
+struct LookupBucket {
+    size_t first;
+    size_t count;
+};
+
+static int compareBucketSize( const void *a, const void *b )
+{
+    const struct LookupBucket *l = (const struct LookupBucket *)a;
+    const struct LookupBucket *r = (const struct LookupBucket *)b;
+
+    if ( l->count != r->count )
+        return l->count < r->count ? 1 : -1;
+    return l->first < r->first ? -1 : l->first > r->first;
+}
+
+/* Builds the minimal perfect hash ('hash, displace' as in Belazzougui
+ * et al.) over the keys into 'table', using the offsets computed by
+ * patchHeaders(). Keys are assigned to one of 'n' buckets first; the
+ * buckets are then placed largest first, each trying displacements until
+ * all of its keys land in free slots. Single-key buckets just take the
+ * next free slot, which is stored as a negative displacement.
+ */
+static int fillLookupTable( struct Resource *table )
+{
+    struct LookupKey *keys;
+    struct LookupBucket *buckets;
+    struct LookupEntry *entries;
+    struct Resource *it;
+    int32_t *displacement;
+    char *keyData;
+    size_t *slots;
+    size_t n, nbuckets = 0, i, j, freeSlot = 0;
+    unsigned int keysSize;
+    uint32_t d;
+    int result = 0;
+
+    n = lookupTableCount( &keysSize );
+    if ( ( table->data = (char *)calloc( 1, table->size ) ) == NULL ||
+         ( keys = (struct LookupKey *)malloc( n * sizeof( *keys ) ) ) == NULL ) {
+        fprintf( stderr, "Failed to allocate lookup table: %s\n", strerror( errno ) );
+        return -1;
+    }
+    buckets = (struct LookupBucket *)malloc( n * sizeof( *buckets ) );
+    slots = (size_t *)malloc( n * sizeof( *slots ) );
+    if ( !buckets || !slots ) {
+        fprintf( stderr, "Failed to allocate lookup table: %s\n", strerror( errno ) );
+        free( keys );
+        free( buckets );
+        free( slots );
+        return -1;
+    }
+
+    displacement = (int32_t *)table->data;
+    entries = (struct LookupEntry *)( displacement + n + ( n & 1 ) );
+    keyData = (char *)( entries + n );
+
+    i = 0;
+    for ( it = resources; it != 0; it = it->next ) {
+        if ( it->generated )
+            continue;
+        keys[ i ].res = it;
+        keys[ i ].key = lookupKeyOf( it );
+        keys[ i ].len = strlen( keys[ i ].key );
+        keys[ i ].bucket = lookupHash( 0, keys[ i ].key, keys[ i ].len ) % n;
+        ++i;
+    }
+    qsort( keys, n, sizeof( *keys ), compareBucket );
+
+    for ( i = 0; i < n; i = j ) {
+        for ( j = i + 1; j < n && keys[ j ].bucket == keys[ i ].bucket; ++j ) {
+            if ( keys[ j ].len == keys[ j - 1 ].len &&
+                 memcmp( keys[ j ].key, keys[ j - 1 ].key, keys[ j ].len ) == 0 ) {
+                fprintf( stderr, "Lookup table key '%s' is not unique.\n", keys[ j ].key );
+                result = -1;
+                goto out;
+            }
+        }
+        buckets[ nbuckets ].first = i;
+        buckets[ nbuckets++ ].count = j - i;
+    }
+    qsort( buckets, nbuckets, sizeof( *buckets ), compareBucketSize );
+
+    for ( i = 0; i < n; ++i )
+        slots[ i ] = n;
+
+    for ( i = 0; i < nbuckets; ++i ) {
+        struct LookupBucket *b = &buckets[ i ];
+        struct LookupKey *k = keys + b->first;
+
+        if ( b->count == 1 ) {
+            while ( slots[ freeSlot ] != n )
+                ++freeSlot;
+            slots[ freeSlot ] = b->first;
+            displacement[ k->bucket ] = -(int32_t)freeSlot - 1;
+            continue;
+        }
+
+        for ( d = 1; d < INT32_MAX; ++d ) {
+            for ( j = 0; j < b->count; ++j ) {
+                size_t slot = lookupHash( d, k[ j ].key, k[ j ].len ) % n;
+                if ( slots[ slot ] != n )
+                    break;
+                slots[ slot ] = b->first + j;
+            }
+            if ( j == b->count )
+                break;
+
+            /* Collision; undo and try the next displacement. */
+            while ( j-- > 0 )
+                slots[ lookupHash( d, k[ j ].key, k[ j ].len ) % n ] = n;
+        }
+        if ( d == INT32_MAX ) {
+            fprintf( stderr, "Failed to compute lookup table.\n" );
+            result = -1;
+            goto out;
+        }
+        displacement[ k->bucket ] = d;
+    }
+
+    /* Everything is stored in the byte order of the target. */
+    for ( i = 0; i < n; ++i )
+        put32( (unsigned char *)&displacement[ i ], displacement[ i ] );
+    for ( i = 0; i < n; ++i ) {
+        const struct LookupKey *k = &keys[ slots[ i ] ];
+        unsigned char *entry = (unsigned char *)&entries[ i ];
+
+        entry = put64( entry, (int64_t)k->res->payloadOffset - (int64_t)table->payloadOffset );
+        entry = put64( entry, k->res->size );
+        entry = put32( entry, keyData - (char *)( entries + n ) );
+        put32( entry, k->len );
+        memcpy( keyData, k->key, k->len + 1 );
+        keyData += k->len + 1;
+    }
+
+out:
+    free( keys );
+    free( buckets );
+    free( slots );
+    return result;
+}
+
+/* Registers the line index of the 'text' resource 'text' as a
+ * resource named <symbol>_lines: the offset of the start of every
+ * line, followed by the length of the text, as 32 bit numbers (or 64
+ * bit ones for texts of 4 GiB and more) in the target's byte order.
+ * The texts need to be read for this before anything is laid out, as
+ * the size of the index has to be known by then. */
+static int addLineIndex( struct Resource *text )
+{
+    const char *data, *p, *nl, *end;
+    size_t len = text->size - 1, width = len > 0xffffffffULL ? 8 : 4;
+    uint64_t count = 0;
+    unsigned char *table, *q;
+    char symbol[ 256 + 6 ];
+    void *map = MAP_FAILED;
+    int fd;
+
+    if ( text->data || len == 0 ) {
+        data = text->data;
+    } else {
+        if ( ( fd = open( text->source, O_RDONLY ) ) == -1 ||
+             ( map = mmap( 0, len, PROT_READ, MAP_PRIVATE, fd, 0 ) ) == MAP_FAILED ) {
+            fprintf( stderr, "Failed to read %s: %s\n", text->filename, strerror( errno ) );
+            if ( fd != -1 )
+                close( fd );
+            return -1;
+        }
+        close( fd );
+        madvise( map, len, MADV_SEQUENTIAL );
+        data = (const char *)map;
+    }
+
+    end = data + len;
+    for ( p = data; p < end; p = nl ? nl + 1 : end, ++count )
+        nl = (const char *)memchr( p, '\n', end - p );
+
+    if ( ( table = (unsigned char *)malloc( ( count + 1 ) * width ) ) == NULL ) {
+        fprintf( stderr, "Failed to allocate memory: %s\n", strerror( errno ) );
+        if ( map != MAP_FAILED )
+            munmap( map, len );
+        return -1;
+    }
+    q = table;
+    for ( p = data; p < end; p = nl ? nl + 1 : end ) {
+        q = width == 8 ? put64( q, p - data ) : put32( q, p - data );
+        nl = (const char *)memchr( p, '\n', end - p );
+    }
+    q = width == 8 ? put64( q, len ) : put32( q, len );
+    if ( map != MAP_FAILED )
+        munmap( map, len );
+
+    snprintf( symbol, sizeof( symbol ), "%s_lines", text->symbol );
+    if ( registerResource( BINARY, symbol, text->filename, ( count + 1 ) * width, width ) == -1 ) {
+        free( table );
+        return -1;
+    }
+    lastResource->type = LINEINDEX;
+    lastResource->generated = 1;
+    lastResource->data = (char *)table;
+    return 0;
+}
+
+/* Adds the line indexes for --line-index. */
+static int addLineIndexes()
+{
+    struct Resource *it, *last = lastResource;
+
+    for ( it = resources; it != 0; it = it->next ) {
+        if ( it->type == TEXT && addLineIndex( it ) == -1 )
+            return -1;
+        if ( it == last )
+            break;
+    }
+    return 0;
+}
+
+/* Registers the XXH64 hash (seed 0) of the contents of 'res' as a
+ * resource named <symbol>_hash, a 64 bit number in the target's byte
+ * order. For 'text' resources, the terminating NUL isn't included. */
+static int addContentHash( struct Resource *res )
+{
+    uint64_t hash;
+    unsigned char *digest;
+    char symbol[ 256 + 5 ];
+    struct Hash h;
+
+    if ( res->data ) {
+        hashInit( &h, 0 );
+        hashUpdate( &h, res->data, res->type == TEXT ? res->size - 1 : res->size );
+        hash = hashFinal( &h );
+    } else if ( hashFile( res->source, &hash ) == -1 ) {
+        fprintf( stderr, "Failed to read %s: %s\n", res->filename, strerror( errno ) );
+        return -1;
+    }
+
+    if ( ( digest = (unsigned char *)malloc( 8 ) ) == NULL ) {
+        fprintf( stderr, "Failed to allocate memory: %s\n", strerror( errno ) );
+        return -1;
+    }
+    put64( digest, hash );
+
+    snprintf( symbol, sizeof( symbol ), "%s_hash", res->symbol );
+    if ( registerResource( BINARY, symbol, res->filename, 8, 8 ) == -1 ) {
+        free( digest );
+        return -1;
+    }
+    lastResource->type = CONTENTHASH;
+    lastResource->generated = 1;
+    lastResource->data = (char *)digest;
+    return 0;
+}
+
+/* Adds the content hashes for --content-hash. */
+static int addContentHashes()
+{
+    struct Resource *it, *last = lastResource;
+
+    for ( it = resources; it != 0; it = it->next ) {
+        if ( !it->generated && addContentHash( it ) == -1 )
+            return -1;
+        if ( it == last )
+            break;
+    }
+    return 0;
+}
+
+/* A pack file written by --pack holds the same payloads as the object
+ * file, laid out the same way, behind a header and an index sorted by
+ * the hash (see lookupHash(), seed 0) of the symbol names:
+ *
+ *   struct { char magic[8]; uint32_t version, count; uint64_t names, payload; } header;
+ *   struct { uint64_t hash, offset, size; uint32_t align, name; } index[ count ];
+ *   char names[];
+ *   payloads, starting at a page boundary (header.payload)
+ *
+ * All offsets count from the start of the file, and everything is in
+ * the byte order of the target, so that it can be used right where
+ * it's mapped. */
+#define PACK_MAGIC "elfrcpak"
+#define PACK_VERSION 1
+#define PACK_HEADERSIZE 32
+#define PACK_ENTRYSIZE 32
+
+struct PackEntry {
+    uint64_t hash;
+    const struct Resource *res;
+};
+
+static int comparePackEntry( const void *a, const void *b )
+{
+    const struct PackEntry *l = (const struct PackEntry *)a;
+    const struct PackEntry *r = (const struct PackEntry *)b;
+
+    if ( l->hash != r->hash )
+        return l->hash < r->hash ? -1 : 1;
+    return strcmp( l->res->symbol, r->res->symbol );
+}
+
+/* Writes the pack file 'fn'. It's written under a temporary name and
+ * renamed into place, so that programs which have the old one mapped
+ * can go on using it until they reload it. */
+static int writePack( const char *fn )
+{
+    struct PackEntry *entries = 0;
+    struct Resource *it;
+    const struct Resource *res;
+    unsigned char *meta = 0, *p;
+    char *tmp = 0;
+    size_t count = 0, namesSize = 0, i;
+    uint64_t namesOffset, metaSize, payload, align, rodataOffset = rodataHeader.sh_offset;
+    int fd = -1, result = -1;
+
+    if ( !fn )
+        return 0;
+
+    if ( verbosity > 0 )
+        printf( "Writing pack file %s\n", fn );
+
+    /* The lookup table is of no use without the ELF object, and zero
+     * filled resources have no payload to map. */
+    for ( it = resources; it != 0; it = it->next ) {
+        if ( it->type != LOOKUPTABLE && !zeroFilled( it ) ) {
+            ++count;
+            namesSize += it->symbolSize;
+        }
+    }
+
+    namesOffset = PACK_HEADERSIZE + PACK_ENTRYSIZE * count;
+    metaSize = namesOffset + namesSize;
+    align = target->pageSize > rodataHeader.sh_addralign ? target->pageSize : rodataHeader.sh_addralign;
+    payload = alignUp( metaSize, align );
+
+    if ( ( entries = (struct PackEntry *)malloc( count * sizeof( *entries ) + 1 ) ) == NULL ||
+         ( meta = (unsigned char *)calloc( 1, metaSize ) ) == NULL ) {
+        fprintf( stderr, "Failed to allocate memory: %s\n", strerror( errno ) );
+        goto out;
+    }
+
+    count = 0;
+    for ( it = resources; it != 0; it = it->next ) {
+        if ( it->type == LOOKUPTABLE || zeroFilled( it ) )
+            continue;
+        entries[ count ].hash = lookupHash( 0, it->symbol, it->symbolSize - 1 );
+        entries[ count++ ].res = it;
+    }
+    qsort( entries, count, sizeof( *entries ), comparePackEntry );
+
+    p = meta;
+    memcpy( p, PACK_MAGIC, 8 );
+    p = put32( p + 8, PACK_VERSION );
+    p = put32( p, count );
+    p = put64( p, namesOffset );
+    p = put64( p, payload );
+    for ( i = 0; i < count; ++i ) {
+        res = entries[ i ].res->alias ? entries[ i ].res->alias : entries[ i ].res;
+        p = put64( p, entries[ i ].hash );
+        p = put64( p, payload + res->payloadOffset );
+        p = put64( p, entries[ i ].res->size );
+        p = put32( p, res->align );
+        p = put32( p, namesOffset );
+        memcpy( meta + namesOffset, entries[ i ].res->symbol, entries[ i ].res->symbolSize );
+        namesOffset += entries[ i ].res->symbolSize;
+    }
+
+    if ( ( fd = createOutput( fn, 0666, &tmp ) ) == -1 )
+        goto out;
+
+    if ( writeBuffer( fd, (const char *)meta, metaSize, NULL ) == -1 ||
+         skipTo( fd, metaSize, payload ) == -1 ) {
+        fprintf( stderr, "Failed to write %s: %s\n", fn, strerror( errno ) );
+        goto out;
+    }
+
+    /* Same payloads, same layout; only the place in the file differs. */
+    rodataHeader.sh_offset = payload;
+    result = writeFiles( fd );
+    rodataHeader.sh_offset = rodataOffset;
+    if ( result == -1 )
+        goto out;
+
+    result = commitOutput( fd, tmp, fn );
+    fd = -1;
+
+out:
+    if ( fd != -1 )
+        discardOutput( fd, tmp );
+    free( meta );
+    free( entries );
+    return result;
+}
+
+static int compareSymbolName( const void *a, const void *b )
+{
+    return strcmp( *(const char * const *)a, *(const char * const *)b );
+}
+
+/* Checks that none of the names the header files define for resources
+ * of the type 'type' is the symbol of another resource: <symbol>_size,
+ * _decompress and _data for compressed ones (ZSTD), <symbol>_lines,
+ * _nlines, _lines_size and _lines_align for the line indexes of texts
+ * (LINEINDEX) and <symbol>_hash and _hash_value for content hashes
+ * (CONTENTHASH). The latter two are checked before they're added. */
+static int checkAccessorNames( int type )
+{
+    static const char *compressed[] = { "_size", "_decompress", "_data", 0 };
+    static const char *lines[] = { "_lines", "_nlines", "_lines_size", "_lines_align", 0 };
+    static const char *hashes[] = { "_hash", "_hash_value", 0 };
+    const char **suffixes = type == LINEINDEX ? lines : type == CONTENTHASH ? hashes : compressed;
+    const char **symbols, *key;
+    struct Resource *it;
+    char name[ 256 + 12 ];
+    size_t count = 0, i;
+    int result = 0;
+
+    for ( it = resources; it != 0; it = it->next )
+        ++count;
+    if ( ( symbols = (const char **)malloc( count * sizeof( *symbols ) + 1 ) ) == NULL ) {
+        fprintf( stderr, "Failed to allocate memory: %s\n", strerror( errno ) );
+        return -1;
+    }
+    count = 0;
+    for ( it = resources; it != 0; it = it->next )
+        symbols[ count++ ] = it->symbol;
+    qsort( symbols, count, sizeof( *symbols ), compareSymbolName );
+
+    for ( it = resources; it != 0 && result == 0; it = it->next ) {
+        if ( type == LINEINDEX ? it->type != TEXT :
+             type == CONTENTHASH ? it->generated : it->type != ZSTD && it->type != LZ4 )
+            continue;
+        for ( i = 0; suffixes[ i ] != 0; ++i ) {
+            snprintf( name, sizeof( name ), "%s%s", it->symbol, suffixes[ i ] );
+            key = name;
+            if ( bsearch( &key, symbols, count, sizeof( *symbols ), compareSymbolName ) ) {
+                fprintf( stderr, "Resource %s clashes with the name the header file defines "
+                                 "for the %s %s.\n", name,
+                         type == LINEINDEX ? "line index of" :
+                         type == CONTENTHASH ? "content hash of" : "compressed resource", it->symbol );
+                result = -1;
+                break;
+            }
+        }
+    }
+
+    free( symbols );
+    return result;
+}
+
+/* Replaces the size of every compressed resource by the size of
+ * its compressed payload, which is kept in memory until
+ * writeFiles() stores it. */
+static int compressResources()
+{
+    struct Resource *it;
+    char *raw;
+    size_t bound = 0, csize = 0;
+
+    for ( it = resources; it != 0; it = it->next ) {
+        if ( it->type != ZSTD && it->type != LZ4 )
+            continue;
+
+        /* The original got compressed already. */
+        if ( it->alias ) {
+            it->size = it->alias->size;
+            continue;
+        }
+
+        if ( verbosity > 0 )
+            printf( "Compressing %s\n", it->filename );
+
+        /* Streams may have been read into memory already. */
+        if ( it->data ) {
+            raw = it->data;
+            it->data = 0;
+        } else if ( ( raw = readFile( it->source, it->rawSize ) ) == NULL ) {
+            return -1;
+        }
+
+#ifdef HAVE_ZSTD
+        if ( it->type == ZSTD )
+            bound = ZSTD_compressBound( it->rawSize );
+#endif
+#ifdef HAVE_LZ4
+        if ( it->type == LZ4 ) {
+            if ( it->rawSize > LZ4_MAX_INPUT_SIZE ) {
+                fprintf( stderr, "%s is too large for LZ4 compression\n", it->filename );
+                free( raw );
+                return -1;
+            }
+            bound = LZ4_compressBound( it->rawSize );
+        }
+#endif
+
+        if ( ( it->data = (char *)malloc( bound + 1 ) ) == NULL ) {
+            fprintf( stderr, "Failed to allocate memory for %s: %s\n", it->filename, strerror( errno ) );
+            free( raw );
+            return -1;
+        }
+
+#ifdef HAVE_ZSTD
+        if ( it->type == ZSTD ) {
+            csize = ZSTD_compress( it->data, bound, raw, it->rawSize, ZSTD_CLEVEL_DEFAULT );
+            if ( ZSTD_isError( csize ) ) {
+                fprintf( stderr, "Failed to compress %s: %s\n", it->filename, ZSTD_getErrorName( csize ) );
+                free( raw );
+                return -1;
+            }
+        }
+#endif
+#ifdef HAVE_LZ4
+        if ( it->type == LZ4 ) {
+            if ( ( csize = LZ4_compress_default( raw, it->data, it->rawSize, bound ) ) == 0 ) {
+                fprintf( stderr, "Failed to compress %s\n", it->filename );
+                free( raw );
+                return -1;
+            }
+        }
+#endif
+
+        free( raw );
+        it->size = csize;
+
+        if ( verbosity > 0 )
+            printf( "Compressed %s from %llu to %llu bytes\n", it->filename,
+                    (unsigned long long)it->rawSize, (unsigned long long)it->size );
+    }
+
+    return 0;
+}
+
+/* Writes the size and the accessors of the uncompressed data of 'it'. */
+static void writeDecompressor( FILE *fd, const struct Resource *it )
+{
+    char data[ 264 ], size[ 272 ];
+
+    fprintf( fd,
+             "#define %s_size %lluu /* uncompressed */\n"
+             "\n"
+             "/* Decompresses %s into 'buffer', which must hold at least\n"
+             " * %s_size bytes. Returns 0 on success, -1 on error. */\n"
+             "static inline int %s_decompress( void *buffer )\n"
+             "{\n",
+             it->symbol, (unsigned long long)it->rawSize, it->symbol, it->symbol, it->symbol );
+    /* With --shared, the data is only reachable through the function
+     * looking it up, which may fail. */
+    if ( sharedObject ) {
+        snprintf( data, sizeof( data ), "%s()", it->symbol );
+        snprintf( size, sizeof( size ), "%lluu", (unsigned long long)it->size );
+        fprintf( fd,
+                 "    if ( !%s )\n"
+                 "        return -1;\n", data );
+    } else {
+        snprintf( data, sizeof( data ), "%s", it->symbol );
+        snprintf( size, sizeof( size ), "sizeof( %s )", it->symbol );
+    }
+    if ( it->type == ZSTD )
+        fprintf( fd,
+                 "    size_t n = ZSTD_decompress( buffer, %s_size, %s, %s );\n"
+                 "    return ZSTD_isError( n ) || n != %s_size ? -1 : 0;\n",
+                 it->symbol, data, size, it->symbol );
+    else
+        fprintf( fd,
+                 "    return LZ4_decompress_safe( %s, (char *)buffer, %s, %s_size ) == %s_size ? 0 : -1;\n",
+                 data, size, it->symbol, it->symbol );
+    fprintf( fd,
+             "}\n"
+             "\n"
+             "/* Returns the uncompressed contents of %s, decompressing them into\n"
+             " * a buffer which lives until the program exits on first use. Returns\n"
+             " * NULL on error. Not thread-safe. */\n"
+             "static inline const char *%s_data( void )\n"
+             "{\n"
+             "    static char *cache;\n"
+             "    char *buffer;\n"
+             "    if ( !cache && ( buffer = (char *)malloc( %s_size + 1 ) ) != NULL ) {\n"
+             "        if ( %s_decompress( buffer ) == 0 )\n"
+             "            cache = buffer;\n"
+             "        else\n"
+             "            free( buffer );\n"
+             "    }\n"
+             "    return cache;\n"
+             "}\n",
+             it->symbol, it->symbol, it->symbol, it->symbol );
+}
+
+/* Writes the declaration of the lookup table 'it' and the code to
+ * look up resources in it. */
+static void writeLookupFunction( FILE *fd, const struct Resource *it )
+{
+    unsigned int n, keysSize;
+    const char *t = it->symbol;
+
+    n = lookupTableCount( &keysSize );
+    fprintf( fd,
+             "\n"
+             "/* Lookup table for the resources above, by %s */\n"
+             "struct %s_entry {\n"
+             "    long long offset;\n"
+             "    unsigned long long size;\n"
+             "    unsigned int key;\n"
+             "    unsigned int keylen;\n"
+             "};\n"
+             "\n"
+             "extern const struct %s_table {\n"
+             "    int displacement[%u];\n"
+             "    struct %s_entry entries[%u];\n"
+             "    char keys[%u];\n"
+             "} %s;\n"
+             "\n"
+             "static inline unsigned long long %s_hash( unsigned long long seed, const char *key, size_t len )\n"
+             "{\n"
+             "    unsigned long long h = 0xcbf29ce484222325ULL ^ ( seed * 0x9e3779b97f4a7c15ULL );\n"
+             "    size_t i;\n"
+             "    for ( i = 0; i < len; ++i ) {\n"
+             "        h ^= (unsigned char)key[ i ];\n"
+             "        h *= 0x100000001b3ULL;\n"
+             "    }\n"
+             "    h ^= h >> 33;\n"
+             "    h *= 0xff51afd7ed558ccdULL;\n"
+             "    h ^= h >> 33;\n"
+             "    return h;\n"
+             "}\n"
+             "\n"
+             "/* Returns the data of the resource with the %s 'key' ('len' bytes\n"
+             " * long) and stores its size in '*size' unless 'size' is NULL.\n"
+             " * Returns NULL if there is no such resource. */\n"
+             "static inline const char *%s_lookup( const char *key, size_t len, size_t *size )\n"
+             "{\n"
+             "    int d = %s.displacement[ %s_hash( 0, key, len ) %% %uu ];\n"
+             "    const struct %s_entry *e = &%s.entries[ d < 0 ? -d - 1 : (int)( %s_hash( d, key, len ) %% %uu ) ];\n"
+             "    if ( e->keylen != len || memcmp( %s.keys + e->key, key, len ) != 0 )\n"
+             "        return 0;\n"
+             "    if ( size )\n"
+             "        *size = e->size;\n"
+             "    return (const char *)&%s + e->offset;\n"
+             "}\n",
+             lookupKey == KeySymbol ? "symbol name" : "file name",
+             t, t, n + ( n & 1 ), t, n, keysSize, t,
+             t,
+             lookupKey == KeySymbol ? "symbol name" : "file name",
+             t, t, t, n, t, t, t, n, t, t );
+}
+
+/* Create a fancy include guard like 'H_2349823487234' from the hash
+ * of the name of the header 'fn' (without directories) and the symbol
+ * names, so that the header doesn't change as long as the resources
+ * don't. The C and C++ headers use different seeds. */
+static void makeIncludeGuard( char includeGuard[ 19 ], const char *fn, uint64_t seed )
+{
+    const char *name = strrchr( fn, '/' ) ? strrchr( fn, '/' ) + 1 : fn;
+    const struct Resource *it;
+    struct Hash h;
+    uint64_t hash;
+    int i;
+
+    hashInit( &h, seed );
+    hashUpdate( &h, name, strlen( name ) + 1 );
+    for ( it = resources; it != 0; it = it->next )
+        hashUpdate( &h, it->symbol, it->symbolSize );
+    hash = hashFinal( &h );
+
+    includeGuard[0] = 'H';
+    includeGuard[1] = '_';
+    for ( i = 17; i >= 2; --i, hash /= 10 )
+        includeGuard[i] = '0' + hash % 10;
+    includeGuard[18] = '\0';
+}
+
+/* Turns the file name of 'fn' (without directories) into a C
+ * identifier in 'id' and returns the file name. */
+static const char *makeIdentifier( const char *fn, char *id, size_t size )
+{
+    const char *name = strrchr( fn, '/' ) ? strrchr( fn, '/' ) + 1 : fn;
+    size_t i;
+
+    snprintf( id, size, "%s%s", isdigit( (unsigned char)name[ 0 ] ) ? "_" : "", name );
+    for ( i = 0; id[ i ]; ++i )
+        if ( !isalnum( (unsigned char)id[ i ] ) )
+            id[ i ] = '_';
+    return name;
+}
+
+/* Writes the functions mapping the pack file written by --pack, named
+ * after the file name 'id'. */
+static void writePackAccessor( FILE *fd, const char *id )
+{
+    fprintf( fd,
+             "\n"
+             "/* Accessors for the pack file written by elfrc --pack, holding the\n"
+             " * resources above: %s_open() maps it, %s_find() looks up a\n"
+             " * resource by symbol name and %s_reload() maps the file again if\n"
+             " * it was changed, e.g. to pick up new assets without restarting or\n"
+             " * relinking. Pointers returned by %s_find() stay valid until the\n"
+             " * next %s_reload() returning 1 or %s_close(). */\n"
+             "struct %s {\n"
+             "    const unsigned char *base;\n"
+             "    size_t size;\n"
+             "    const char *path;\n"
+             "    dev_t dev;\n"
+             "    ino_t ino;\n"
+             "    struct timespec mtime;\n"
+             "};\n"
+             "\n"
+             "struct %s_header {\n"
+             "    char magic[8];\n"
+             "    unsigned int version;\n"
+             "    unsigned int count;\n"
+             "    unsigned long long names;\n"
+             "    unsigned long long payload;\n"
+             "};\n"
+             "\n"
+             "struct %s_entry {\n"
+             "    unsigned long long hash;\n"
+             "    unsigned long long offset;\n"
+             "    unsigned long long size;\n"
+             "    unsigned int align;\n"
+             "    unsigned int name;\n"
+             "};\n"
+             "\n",
+             id, id, id, id, id, id, id, id, id );
+    fprintf( fd,
+             "static inline unsigned long long %s_hash( const char *key, size_t len )\n"
+             "{\n"
+             "    unsigned long long h = 0xcbf29ce484222325ULL;\n"
+             "    size_t i;\n"
+             "    for ( i = 0; i < len; ++i ) {\n"
+             "        h ^= (unsigned char)key[ i ];\n"
+             "        h *= 0x100000001b3ULL;\n"
+             "    }\n"
+             "    h ^= h >> 33;\n"
+             "    h *= 0xff51afd7ed558ccdULL;\n"
+             "    h ^= h >> 33;\n"
+             "    return h;\n"
+             "}\n"
+             "\n"
+             "static inline int %s_map( struct %s *pack, const char *path )\n"
+             "{\n"
+             "    const struct %s_header *h;\n"
+             "    struct stat sb;\n"
+             "    void *base;\n"
+             "    int fd;\n"
+             "    if ( ( fd = open( path, O_RDONLY ) ) == -1 )\n"
+             "        return -1;\n"
+             "    if ( fstat( fd, &sb ) == -1 || sb.st_size < (off_t)sizeof( *h ) ||\n"
+             "         ( base = mmap( 0, sb.st_size, PROT_READ, MAP_SHARED, fd, 0 ) ) == MAP_FAILED ) {\n"
+             "        close( fd );\n"
+             "        return -1;\n"
+             "    }\n"
+             "    close( fd );\n"
+             "    h = (const struct %s_header *)base;\n"
+             "    if ( memcmp( h->magic, \"" PACK_MAGIC "\", 8 ) != 0 || h->version != %u ||\n"
+             "         h->names > (unsigned long long)sb.st_size || h->names < sizeof( *h ) ||\n"
+             "         ( h->names - sizeof( *h ) ) / sizeof( struct %s_entry ) < h->count ) {\n"
+             "        munmap( base, sb.st_size );\n"
+             "        errno = EINVAL;\n"
+             "        return -1;\n"
+             "    }\n"
+             "    pack->base = (const unsigned char *)base;\n"
+             "    pack->size = sb.st_size;\n"
+             "    pack->path = path;\n"
+             "    pack->dev = sb.st_dev;\n"
+             "    pack->ino = sb.st_ino;\n"
+             "    pack->mtime = sb.st_mtim;\n"
+             "    return 0;\n"
+             "}\n"
+             "\n"
+             "/* Maps the pack file 'path', which must stay around as long as\n"
+             " * 'pack' is used. Returns 0 on success, -1 on error (see errno). */\n"
+             "static inline int %s_open( struct %s *pack, const char *path )\n"
+             "{\n"
+             "    pack->base = 0;\n"
+             "    return %s_map( pack, path );\n"
+             "}\n"
+             "\n"
+             "/* Maps the pack file again if it changed since. Returns 1 if it\n"
+             " * did, 0 if not and -1 on error, which leaves the old one mapped. */\n"
+             "static inline int %s_reload( struct %s *pack )\n"
+             "{\n"
+             "    struct %s fresh;\n"
+             "    struct stat sb;\n"
+             "    if ( stat( pack->path, &sb ) == -1 )\n"
+             "        return -1;\n"
+             "    if ( sb.st_dev == pack->dev && sb.st_ino == pack->ino &&\n"
+             "         sb.st_mtim.tv_sec == pack->mtime.tv_sec && sb.st_mtim.tv_nsec == pack->mtime.tv_nsec )\n"
+             "        return 0;\n"
+             "    if ( %s_map( &fresh, pack->path ) == -1 )\n"
+             "        return -1;\n"
+             "    munmap( (void *)pack->base, pack->size );\n"
+             "    *pack = fresh;\n"
+             "    return 1;\n"
+             "}\n"
+             "\n"
+             "static inline void %s_close( struct %s *pack )\n"
+             "{\n"
+             "    if ( pack->base )\n"
+             "        munmap( (void *)pack->base, pack->size );\n"
+             "    pack->base = 0;\n"
+             "}\n"
+             "\n",
+             id, id, id, id, id, PACK_VERSION, id, id, id, id, id, id, id, id, id, id );
+    fprintf( fd,
+             "/* Returns the data of the resource with the symbol name 'name' and\n"
+             " * stores its size in '*size' unless 'size' is NULL. Returns NULL if\n"
+             " * there is no such resource. */\n"
+             "static inline const char *%s_find( const struct %s *pack, const char *name, size_t *size )\n"
+             "{\n"
+             "    const struct %s_header *h = (const struct %s_header *)pack->base;\n"
+             "    const struct %s_entry *index = (const struct %s_entry *)( h + 1 ), *e;\n"
+             "    unsigned long long hash = %s_hash( name, strlen( name ) );\n"
+             "    size_t lo = 0, hi = h->count, mid;\n"
+             "    while ( lo < hi ) {\n"
+             "        mid = lo + ( hi - lo ) / 2;\n"
+             "        if ( index[ mid ].hash < hash )\n"
+             "            lo = mid + 1;\n"
+             "        else\n"
+             "            hi = mid;\n"
+             "    }\n"
+             "    for ( e = index + lo; e < index + h->count && e->hash == hash; ++e ) {\n"
+             "        if ( e->name >= pack->size || e->offset > pack->size || e->size > pack->size - e->offset ||\n"
+             "             strncmp( (const char *)pack->base + e->name, name, pack->size - e->name ) != 0 )\n"
+             "            continue;\n"
+             "        if ( size )\n"
+             "            *size = e->size;\n"
+             "        return (const char *)pack->base + e->offset;\n"
+             "    }\n"
+             "    return 0;\n"
+             "}\n",
+             id, id, id, id, id, id, id );
+}
+
+/* Returns the symbol of the text resource the line index 'it' is for. */
+static const char *lineIndexOf( const struct Resource *it )
+{
+    static char symbol[ 256 ];
+
+    snprintf( symbol, sizeof( symbol ), "%.*s", (int)( it->symbolSize - 1 - strlen( "_lines" ) ), it->symbol );
+    return symbol;
+}
+
+/* Returns the hash stored in the content hash resource 'it'. */
+static unsigned long long contentHashOf( const struct Resource *it )
+{
+    const unsigned char *p = (const unsigned char *)it->data;
+    unsigned long long hash = 0;
+    int i;
+
+    for ( i = 0; i < 8; ++i )
+        hash |= (unsigned long long)p[ i ] << ( target->elfData == ELFDATA2LSB ? i * 8 : 56 - i * 8 );
+    return hash;
+}
+
+/* Writes the function returning the handle of the shared object 'so'
+ * written by --shared, named after the file name. */
+static void writeLoader( FILE *fd, const char *so, char *loader, size_t size )
+{
+    const char *soname = makeIdentifier( so, loader, size );
+
+    fprintf( fd,
+             "\n"
+             "/* Define %s_PATH to load %s from elsewhere\n"
+             " * than the directories searched by dlopen(). */\n"
+             "#ifndef %s_PATH\n"
+             "#  define %s_PATH \"%s\"\n"
+             "#endif\n"
+             "\n"
+             "/* Returns the handle of %s, loading it on first use,\n"
+             " * or NULL if that fails (see dlerror()). */\n"
+             "static inline void *%s( void )\n"
+             "{\n"
+             "    static void *handle;\n"
+             "    if ( !handle )\n"
+             "        handle = dlopen( %s_PATH, RTLD_LAZY | RTLD_LOCAL );\n"
+             "    return handle;\n"
+             "}\n",
+             loader, soname, loader, loader, soname, soname, loader, loader );
+}
+
+/* Writes the function returning the address of resource 'it' in the
+ * shared object, which is looked up by 'loader'. */
+static void writeAccessor( FILE *fd, const struct Resource *it, const char *loader )
+{
+    const char *type = it->type == CONTENTHASH ? "uint64_t" :
+                       it->type != LINEINDEX ? "char" : it->align == 8 ? "uint64_t" : "uint32_t";
+
+    if ( it->type != ZSTD && it->type != LZ4 )
+        fprintf( fd, "#define %s_size %lluu\n", it->symbol, (unsigned long long)it->size );
+    fprintf( fd,
+             "static inline const %s *%s( void )\n"
+             "{\n"
+             "    static const %s *data;\n"
+             "    if ( !data && %s() )\n"
+             "        data = (const %s *)dlsym( %s(), \"%s\" );\n"
+             "    return data;\n"
+             "}\n",
+             type, it->symbol, type, loader, type, loader, it->symbol );
+}
+
+/* Writes the functions giving the kernel hints about the pages of the
+ * page aligned resource 'it', which it has to itself. */
+static void writePagingHelpers( FILE *fd, const struct Resource *it )
+{
+    const struct Resource *res = it->alias ? it->alias : it;
+    const char *s = it->symbol;
+
+    fprintf( fd,
+             "\n"
+             "/* Paging hints for the pages of %s: %s_prefetch() reads them in\n"
+             " * (or at least starts to), %s_hugepage() asks for transparent huge\n"
+             " * pages and %s_dontneed() drops them until they're used again.\n"
+             " * They return 0 on success, -1 on error (see errno). */\n"
+             "#define %s_span %lluu\n"
+             "static inline int %s_advise( int advice )\n"
+             "{\n",
+             s, s, s, s, s, (unsigned long long)alignUp( it->size, res->align ), s );
+    if ( sharedObject )
+        fprintf( fd,
+                 "    void *p = (void *)%s();\n"
+                 "    if ( !p ) {\n"
+                 "        errno = ENOENT;\n"
+                 "        return -1;\n"
+                 "    }\n", s );
+    else
+        fprintf( fd, "    void *p = (void *)%s;\n", s );
+    fprintf( fd,
+             "    return madvise( p, %s_span, advice );\n"
+             "}\n"
+             "static inline int %s_prefetch( void )\n"
+             "{\n"
+             "#ifdef MADV_POPULATE_READ\n"
+             "    if ( %s_advise( MADV_POPULATE_READ ) == 0 )\n"
+             "        return 0;\n"
+             "#endif\n"
+             "    return %s_advise( MADV_WILLNEED );\n"
+             "}\n"
+             "static inline int %s_hugepage( void )\n"
+             "{\n"
+             "#ifdef MADV_HUGEPAGE\n"
+             "    return %s_advise( MADV_HUGEPAGE );\n"
+             "#else\n"
+             "    errno = ENOSYS;\n"
+             "    return -1;\n"
+             "#endif\n"
+             "}\n"
+             "static inline int %s_dontneed( void )\n"
+             "{\n"
+             "    return %s_advise( MADV_DONTNEED );\n"
+             "}\n",
+             s, s, s, s, s, s, s, s );
+}
+
+/* Writes the C header for the resources; with --shared, they're
+ * reached through functions looking them up in the shared object 'so'
+ * rather than declared as arrays. */
+static int writeCHeader( const char *fn, const char *so )
+{
+    FILE *fd;
+    char *tmp;
+    struct Resource *it;
+    char includeGuard[ 19 ];
+    char loader[ PATH_MAX + 1 ];
+    int needZstd = 0, needLz4 = 0, needString = 0, needMman = 0, needStdint = 0;
+
+    if ( !fn )
+        return 0;
+
+    if ( verbosity > 0 )
+        printf( "Writing header file %s\n", fn );
+
+    if ( ( fd = openStream( fn, &tmp ) ) == NULL )
+        return -1;
+
+    makeIncludeGuard( includeGuard, fn, 0 );
+
+    /* Write include guard, the headers needed by the decompressing
+     * accessors and C++ fixup out. */
+    fprintf( fd,
+             "#ifndef %s\n"
+             "#define %s\n"
+             "\n", includeGuard, includeGuard );
+
+    for ( it = resources; it != 0; it = it->next ) {
+        if ( it->type == ZSTD )
+            needZstd = 1;
+        else if ( it->type == LZ4 )
+            needLz4 = 1;
+        else if ( it->type == LOOKUPTABLE )
+            needString = 1;
+        else if ( it->type == LINEINDEX || it->type == CONTENTHASH )
+            needStdint = 1;
+        if ( ( it->alias ? it->alias : it )->align >= target->pageSize )
+            needMman = 1;
+    }
+    if ( needZstd || needLz4 )
+        fprintf( fd, "#include <stdlib.h>\n" );
+    if ( packOutput || needMman )
+        fprintf( fd,
+                 "#include <sys/mman.h>\n" );
+    if ( packOutput )
+        fprintf( fd,
+                 "#include <sys/stat.h>\n" );
+    if ( packOutput || needMman )
+        fprintf( fd,
+                 "#include <errno.h>\n" );
+    if ( packOutput )
+        fprintf( fd,
+                 "#include <fcntl.h>\n"
+                 "#include <stddef.h>\n"
+                 "#include <time.h>\n"
+                 "#include <unistd.h>\n" );
+    if ( needStdint )
+        fprintf( fd, "#include <stdint.h>\n" );
+    if ( needString || packOutput )
+        fprintf( fd, "#include <string.h>\n" );
+    if ( needZstd )
+        fprintf( fd, "#include <zstd.h>\n" );
+    if ( needLz4 )
+        fprintf( fd, "#include <lz4.h>\n" );
+    if ( sharedObject )
+        fprintf( fd, "#include <dlfcn.h>\n" );
+    if ( needZstd || needLz4 || needString || needMman || needStdint || sharedObject || packOutput )
+        fprintf( fd, "\n" );
+
+    fprintf( fd,
+             "#ifdef __cplusplus\n"
+             "extern \"C\" {\n"
+             "#endif\n"
+             "\n" );
+
+    fprintf( fd,
+            "/* Automatically generated by elfrc " ELFRC_VERSION ". "
+            "Do not modify by hand. */\n" );
+
+    if ( sharedObject )
+        writeLoader( fd, so, loader, sizeof( loader ) );
+
+    for ( it = resources; it != 0; it = it->next ) {
+        if ( it->type == LOOKUPTABLE ) {
+            writeLookupFunction( fd, it );
+            continue;
+        }
+        if ( it->type == LINEINDEX ) {
+            fprintf( fd,
+                     "\n"
+                     "/* Line index of %s: %s[ n ] is the offset of line n,\n"
+                     " * %s[ %s_nlines ] the length of the text. */\n"
+                     "#define %s_nlines %lluu\n",
+                     it->filename, it->symbol, it->symbol, lineIndexOf( it ), lineIndexOf( it ),
+                     (unsigned long long)( it->size / it->align - 1 ) );
+            if ( sharedObject )
+                writeAccessor( fd, it, loader );
+            else
+                fprintf( fd, "extern const uint%u_t %s[%llu];\n",
+                         it->align * 8, it->symbol, (unsigned long long)( it->size / it->align ) );
+            continue;
+        }
+        if ( it->type == CONTENTHASH ) {
+            fprintf( fd,
+                     "\n"
+                     "/* XXH64 hash of %s */\n"
+                     "#define %s_value 0x%016llxull\n",
+                     it->filename, it->symbol, contentHashOf( it ) );
+            if ( sharedObject )
+                writeAccessor( fd, it, loader );
+            else
+                fprintf( fd, "extern const uint64_t %s;\n", it->symbol );
+            continue;
+        }
+        if ( zeroFilled( it ) )
+            fprintf( fd,
+                     "\n"
+                     "/* %llu zero bytes */\n", (unsigned long long)it->size );
+        else
+            fprintf( fd,
+                     "\n"
+                     "/* %s */\n", it->filename );
+        if ( sharedObject )
+            writeAccessor( fd, it, loader );
+        else
+            fprintf( fd, "extern %schar %s[%llu];\n", it->type == ZERO ? "" : "const ",
+                     it->symbol, (unsigned long long)it->size );
+        if ( it->type == ZSTD || it->type == LZ4 )
+            writeDecompressor( fd, it );
+        if ( ( it->alias ? it->alias : it )->align >= target->pageSize )
+            writePagingHelpers( fd, it );
+    }
+
+    if ( packOutput ) {
+        makeIdentifier( packOutput, loader, sizeof( loader ) );
+        writePackAccessor( fd, loader );
+    }
+
+    /* Write include guard and C++ fixup out. */
+    fprintf( fd,
+             "\n"
+             "#ifdef __cplusplus\n"
+             "} /* extern \"C\" */\n"
+             "#endif\n"
+             "\n"
+             "#endif /* %s */\n", includeGuard );
+
+    return commitStream( fd, tmp, fn );
+}
+
+/* Writes a C++ (20) header declaring every resource as constexpr
+ * std::string_view (text) or fixed-extent std::span<const std::byte>
+ * in namespace 'elfrc', along with its size and alignment as compile
+ * time constants. The raw arrays are declared in namespace elfrc::raw
+ * with C linkage; they're typed differently than in the C header, so
+ * the two headers can't be included into the same file. */
+static int writeCXXHeader( const char *fn )
+{
+    FILE *fd;
+    char *tmp;
+    struct Resource *it;
+    char includeGuard[ 19 ];
+
+    if ( !fn )
+        return 0;
+
+    if ( verbosity > 0 )
+        printf( "Writing C++ header file %s\n", fn );
+
+    if ( ( fd = openStream( fn, &tmp ) ) == NULL )
+        return -1;
+
+    makeIncludeGuard( includeGuard, fn, 1 );
+
+    fprintf( fd,
+             "#ifndef %s\n"
+             "#define %s\n"
+             "\n"
+             "#include <cstddef>\n"
+             "#include <cstdint>\n"
+             "#include <span>\n"
+             "#include <string_view>\n"
+             "\n"
+             "/* Automatically generated by elfrc " ELFRC_VERSION ". "
+             "Do not modify by hand. */\n"
+             "\n"
+             "namespace elfrc {\n"
+             "\n"
+             "namespace raw {\n"
+             "extern \"C\" {\n", includeGuard, includeGuard );
+
+    for ( it = resources; it != 0; it = it->next ) {
+        /* The lookup table is only usable from the C header, content
+         * hashes are constants of their own. */
+        if ( it->type == LOOKUPTABLE || it->type == CONTENTHASH )
+            continue;
+        if ( it->type == LINEINDEX ) {
+            fprintf( fd, "alignas( %u ) extern const std::uint%u_t %s[%llu];\n",
+                     it->align, it->align * 8,
+                     it->symbol, (unsigned long long)( it->size / it->align ) );
+            continue;
+        }
+        fprintf( fd, "alignas( %u ) extern %s %s[%llu];\n",
+                 alignment( it->alias ? it->alias : it ),
+                 it->type == TEXT ? "const char" : it->type == ZERO ? "std::byte" : "const std::byte",
+                 it->symbol, (unsigned long long)it->size );
+    }
+
+    fprintf( fd,
+             "} /* extern \"C\" */\n"
+             "} /* namespace raw */\n" );
+
+    for ( it = resources; it != 0; it = it->next ) {
+        if ( it->type == LOOKUPTABLE )
+            continue;
+        if ( it->type == CONTENTHASH ) {
+            fprintf( fd,
+                     "\n"
+                     "/* XXH64 hash of %s */\n"
+                     "inline constexpr std::uint64_t %s = 0x%016llxull;\n",
+                     it->filename, it->symbol, contentHashOf( it ) );
+            continue;
+        }
+        if ( zeroFilled( it ) )
+            fprintf( fd,
+                     "\n"
+                     "/* %llu zero bytes */\n", (unsigned long long)it->size );
+        else
+            fprintf( fd,
+                     "\n"
+                     "/* %s */\n", it->filename );
+        fprintf( fd,
+                 "inline constexpr std::size_t %s_size = %lluu;\n"
+                 "inline constexpr std::size_t %s_align = %uu;\n",
+                 it->symbol, (unsigned long long)it->size,
+                 it->symbol, alignment( it->alias ? it->alias : it ) );
+        if ( it->type == TEXT )
+            fprintf( fd, "inline constexpr std::string_view %s{ raw::%s, %s_size - 1 };\n",
+                     it->symbol, it->symbol, it->symbol );
+        else if ( it->type == LINEINDEX )
+            fprintf( fd,
+                     "inline constexpr std::size_t %s_nlines = %lluu;\n"
+                     "inline constexpr std::span<const std::uint%u_t, %s_nlines + 1> %s{ raw::%s };\n",
+                     lineIndexOf( it ), (unsigned long long)( it->size / it->align - 1 ),
+                     it->align * 8, lineIndexOf( it ), it->symbol, it->symbol );
+        else
+            fprintf( fd, "inline constexpr std::span<%s, %s_size> %s{ raw::%s };\n",
+                     it->type == ZERO ? "std::byte" : "const std::byte",
+                     it->symbol, it->symbol, it->symbol );
+        if ( it->type == ZSTD || it->type == LZ4 )
+            fprintf( fd, "inline constexpr std::size_t %s_uncompressed_size = %lluu;\n",
+                     it->symbol, (unsigned long long)it->rawSize );
+    }
+
+    fprintf( fd,
+             "\n"
+             "} /* namespace elfrc */\n"
+             "\n"
+             "#endif /* %s */\n", includeGuard );
+
+    return commitStream( fd, tmp, fn );
+}
+
+static void writeJSONString( FILE *fd, const char *s )
+{
+    fputc( '"', fd );
+    for ( ; *s; ++s ) {
+        if ( *s == '"' || *s == '\\' )
+            fprintf( fd, "\\%c", *s );
+        else if ( (unsigned char)*s < 0x20 )
+            fprintf( fd, "\\u%04x", (unsigned char)*s );
+        else
+            fputc( *s, fd );
+    }
+    fputc( '"', fd );
+}
+
+static int compareCopyTime( const void *a, const void *b )
+{
+    const struct Resource *l = *(const struct Resource * const *)a;
+    const struct Resource *r = *(const struct Resource * const *)b;
+
+    if ( l->copySeconds != r->copySeconds )
+        return l->copySeconds < r->copySeconds ? 1 : -1;
     return 0;
 }
 
-static int writeELFRelocatable( const char *fn )
+/* Writes 'count' entries of 'items' as a JSON array of resources. */
+static void writeStatsResources( FILE *fd, struct Resource **items, size_t count )
 {
-    int fd;
+    size_t i;
+
+    fprintf( fd, "[" );
+    for ( i = 0; i < count; ++i ) {
+        fprintf( fd, "%s\n    { \"symbol\": ", i > 0 ? "," : "" );
+        writeJSONString( fd, items[ i ]->symbol );
+        fprintf( fd, ", \"file\": " );
+        writeJSONString( fd, items[ i ]->filename );
+        fprintf( fd, ", \"bytes\": %llu, \"copySeconds\": %.6f, \"mbPerSecond\": %.1f }",
+                 (unsigned long long)items[ i ]->size, items[ i ]->copySeconds,
+                 items[ i ]->copySeconds > 0 ? items[ i ]->size / items[ i ]->copySeconds / 1e6 : 0.0 );
+    }
+    fprintf( fd, "%s]", count > 0 ? "\n  " : "" );
+}
+
+/* Writes what markPhase()/endPhase() and friends collected as JSON to
+ * 'fn' (or to the standard output if 'fn' is "-"): the phases, the
+ * amount of payload and padding, and the largest and the slowest
+ * resources to copy. */
+static int writeStats( const char *fn, unsigned int nobjects )
+{
+    FILE *fd;
+    struct Resource *it, **items;
+    struct rusage usage;
+    size_t count = 0, payload = 0, shown;
+    const struct Phase *copy = 0;
+    unsigned int i;
+
+    if ( !fn )
+        return 0;
+
+    for ( it = resources; it != 0; it = it->next ) {
+        if ( it->generated || it->alias )
+            continue;
+        ++count;
+        payload += it->size;
+    }
+    if ( ( items = (struct Resource **)malloc( count * sizeof( *items ) + 1 ) ) == NULL ) {
+        fprintf( stderr, "Failed to allocate memory: %s\n", strerror( errno ) );
+        return -1;
+    }
+    count = 0;
+    for ( it = resources; it != 0; it = it->next )
+        if ( !it->generated && !it->alias )
+            items[ count++ ] = it;
+    shown = count < 10 ? count : 10;
+
+    if ( strcmp( fn, "-" ) == 0 ) {
+        fd = stdout;
+    } else if ( ( fd = fopen( fn, "w" ) ) == NULL ) {
+        fprintf( stderr, "Failed to open %s for writing: %s\n", fn, strerror( errno ) );
+        free( items );
+        return -1;
+    }
+
+    getrusage( RUSAGE_SELF, &usage );
+    fprintf( fd,
+             "{\n"
+             "  \"version\": \"" ELFRC_VERSION "\",\n"
+             "  \"resources\": %llu,\n"
+             "  \"objects\": %u,\n"
+             "  \"payloadBytes\": %llu,\n"
+             "  \"paddingBytes\": %llu,\n"
+             "  \"userSeconds\": %.3f,\n"
+             "  \"systemSeconds\": %.3f,\n"
+             "  \"phases\": [",
+             (unsigned long long)count, nobjects,
+             (unsigned long long)payload, (unsigned long long)paddingBytes,
+             usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6,
+             usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6 );
+    for ( i = 0; i < phaseCount; ++i ) {
+        fprintf( fd, "%s\n    { \"name\": \"%s\", \"seconds\": %.6f, \"ioSyscalls\": ",
+                 i > 0 ? "," : "", phases[ i ].name, phases[ i ].seconds );
+        if ( phases[ i ].syscalls == -1 )
+            fprintf( fd, "null }" );
+        else
+            fprintf( fd, "%lld }", phases[ i ].syscalls );
+        if ( strcmp( phases[ i ].name, "write.payload" ) == 0 )
+            copy = &phases[ i ];
+    }
+    fprintf( fd, "\n  ],\n" );
+
+    if ( copy )
+        fprintf( fd, "  \"payloadMbPerSecond\": %.1f,\n",
+                 copy->seconds > 0 ? payload / copy->seconds / 1e6 : 0.0 );
+
+    qsort( items, count, sizeof( *items ), compareSizeDescending );
+    fprintf( fd, "  \"largest\": " );
+    writeStatsResources( fd, items, shown );
+    qsort( items, count, sizeof( *items ), compareCopyTime );
+    fprintf( fd, ",\n  \"slowest\": " );
+    writeStatsResources( fd, items, copy ? shown : 0 );
+    fprintf( fd, "\n}\n" );
+
+    free( items );
+    if ( fd == stdout )
+        return fflush( fd );
+    return fclose( fd );
+}
+
+/* Writes 'fn' to 'fd' escaped the way make (and ninja) expect it in
+ * dependency files. */
+static void writeDependencyName( FILE *fd, const char *fn )
+{
+    for ( ; *fn; ++fn ) {
+        if ( *fn == ' ' || *fn == '\t' || *fn == '#' )
+            fputc( '\\', fd );
+        else if ( *fn == '$' )
+            fputc( '$', fd );
+        fputc( *fn, fd );
+    }
+}
+
+/* Writes a dependency file like 'gcc -MD -MP' does, saying that
+ * 'target' depends on the resource file, every embedded file and every
+ * directory read for 'dir' lines, each of which also gets an empty rule
+ * so that make doesn't fail once it's gone. If 'nshards' is not 0,
+ * 'target' is the pattern for the names of that many object files, all
+ * of which are listed as targets. */
+static int writeDependencyFile( const char *fn, const char *target,
+                                unsigned int nshards, const char *resfile )
+{
+    FILE *fd;
+    struct Resource *it;
+    const struct ScannedDirectory *dir;
+    char shardName[ PATH_MAX ];
+    unsigned int k;
 
     if ( !fn )
         return 0;
 
-    if ( verbosity > 0 )
-        printf( "Writing ELF relocatable file %s\n", fn );
+    if ( verbosity > 0 )
+        printf( "Writing dependency file %s\n", fn );
+
+    if ( ( fd = fopen( fn, "w" ) ) == NULL ) {
+        fprintf( stderr, "Failed to open %s for writing: %s\n",
+                 fn, strerror( errno ) );
+        return -1;
+    }
+
+    if ( nshards == 0 ) {
+        writeDependencyName( fd, target );
+    } else {
+        for ( k = 0; k < nshards; ++k ) {
+            snprintf( shardName, sizeof( shardName ), target, k );
+            if ( k > 0 )
+                fputc( ' ', fd );
+            writeDependencyName( fd, shardName );
+        }
+    }
+    fputc( ':', fd );
+    if ( resfile && strcmp( resfile, "-" ) != 0 ) {
+        fputs( " \\\n ", fd );
+        writeDependencyName( fd, resfile );
+    }
+    for ( it = resources; it != 0; it = it->next ) {
+        if ( it->generated )
+            continue;
+        fputs( " \\\n ", fd );
+        writeDependencyName( fd, it->filename );
+    }
+    for ( dir = scannedDirectories; dir != 0; dir = dir->next ) {
+        fputs( " \\\n ", fd );
+        writeDependencyName( fd, dir->path );
+    }
+    fputc( '\n', fd );
+
+    if ( resfile && strcmp( resfile, "-" ) != 0 ) {
+        fputc( '\n', fd );
+        writeDependencyName( fd, resfile );
+        fputs( ":\n", fd );
+    }
+    for ( it = resources; it != 0; it = it->next ) {
+        if ( it->generated )
+            continue;
+        fputc( '\n', fd );
+        writeDependencyName( fd, it->filename );
+        fputs( ":\n", fd );
+    }
+    for ( dir = scannedDirectories; dir != 0; dir = dir->next ) {
+        fputc( '\n', fd );
+        writeDependencyName( fd, dir->path );
+        fputs( ":\n", fd );
+    }
+
+    return fclose( fd );
+}
+
+/* What a client sends to the server, followed by 'length' bytes
+ * holding its working directory and the 'argc' arguments, each one
+ * terminated by a zero byte. Its standard input, output and error
+ * go along as SCM_RIGHTS. */
+struct Request {
+    uint32_t magic;
+    uint32_t argc;
+    uint32_t length;
+    uint32_t umask;
+};
+
+#define REQUEST_MAGIC 0x31726665
+
+static int compile( int argc, char **argv );
+
+/* Runs in the process forked for the connection 'conn': receives the
+ * request and compiles as if started by the client, i.e. in its
+ * working directory, with its umask and standard file descriptors. */
+static int runRequest( int conn )
+{
+    struct Request req;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr header;
+        char buffer[ CMSG_SPACE( 3 * sizeof( int ) ) ];
+    } control;
+    int fds[ 3 ];
+    char *payload, *p, **argv;
+    unsigned int i;
+    ssize_t nread;
+    size_t off;
+
+    memset( &msg, 0, sizeof( msg ) );
+    iov.iov_base = &req;
+    iov.iov_len = sizeof( req );
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof( control.buffer );
+    if ( recvmsg( conn, &msg, MSG_WAITALL ) != sizeof( req ) || req.magic != REQUEST_MAGIC ||
+         ( cmsg = CMSG_FIRSTHDR( &msg ) ) == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+         cmsg->cmsg_len != CMSG_LEN( sizeof( fds ) ) )
+        return -1;
+    memcpy( fds, CMSG_DATA( cmsg ), sizeof( fds ) );
+    for ( i = 0; i < 3; ++i ) {
+        dup2( fds[ i ], i );
+        if ( fds[ i ] > 2 )
+            close( fds[ i ] );
+    }
+
+    if ( ( payload = (char *)malloc( req.length + 1 ) ) == NULL ||
+         ( argv = (char **)malloc( ( req.argc + 1 ) * sizeof( char * ) ) ) == NULL ) {
+        fprintf( stderr, "Failed to allocate memory: %s\n", strerror( errno ) );
+        return -1;
+    }
+    for ( off = 0; off < req.length; off += nread ) {
+        if ( ( nread = read( conn, payload + off, req.length - off ) ) <= 0 ) {
+            fprintf( stderr, "Failed to receive the request: %s\n",
+                     nread == 0 ? "connection closed" : strerror( errno ) );
+            return -1;
+        }
+    }
+    payload[ req.length ] = '\0';
+
+    p = payload;
+    cacheDirectory = p;
+    for ( i = 0; i < req.argc; ++i ) {
+        p += strlen( p ) + 1;
+        if ( p >= payload + req.length ) {
+            fprintf( stderr, "Malformed request.\n" );
+            return -1;
+        }
+        argv[ i ] = p;
+    }
+    argv[ req.argc ] = 0;
+
+    if ( chdir( cacheDirectory ) == -1 ) {
+        fprintf( stderr, "Failed to change to %s: %s\n", cacheDirectory, strerror( errno ) );
+        return -1;
+    }
+    umask( req.umask );
+
+    return compile( req.argc, argv );
+}
+
+/* Hands the command line over to the server listening on 'path' and
+ * returns the exit status of the request, or -1 if there's no server,
+ * in which case the caller should do the work itself. */
+static int forwardRequest( const char *path, int argc, char **argv )
+{
+    struct sockaddr_un addr;
+    struct Request req;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr header;
+        char buffer[ CMSG_SPACE( 3 * sizeof( int ) ) ];
+    } control;
+    static const int fds[ 3 ] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    char cwd[ PATH_MAX ];
+    char *payload, *p;
+    size_t len;
+    mode_t mask;
+    int fd, i, status;
+
+    if ( strlen( path ) >= sizeof( addr.sun_path ) || getcwd( cwd, sizeof( cwd ) ) == NULL )
+        return -1;
+
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sun_family = AF_UNIX;
+    strcpy( addr.sun_path, path );
+    if ( ( fd = socket( AF_UNIX, SOCK_STREAM, 0 ) ) == -1 )
+        return -1;
+    if ( connect( fd, (struct sockaddr *)&addr, sizeof( addr ) ) == -1 ) {
+        close( fd );
+        return -1;
+    }
+
+    len = strlen( cwd ) + 1;
+    for ( i = 0; i < argc; ++i )
+        len += strlen( argv[ i ] ) + 1;
+    if ( ( payload = (char *)malloc( len ) ) == NULL ) {
+        close( fd );
+        return -1;
+    }
+    p = payload;
+    p = stpcpy( p, cwd ) + 1;
+    for ( i = 0; i < argc; ++i )
+        p = stpcpy( p, argv[ i ] ) + 1;
+
+    mask = umask( 0 );
+    umask( mask );
+    req.magic = REQUEST_MAGIC;
+    req.argc = argc;
+    req.length = len;
+    req.umask = mask;
+
+    memset( &msg, 0, sizeof( msg ) );
+    iov.iov_base = &req;
+    iov.iov_len = sizeof( req );
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof( control.buffer );
+    cmsg = CMSG_FIRSTHDR( &msg );
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN( sizeof( fds ) );
+    memcpy( CMSG_DATA( cmsg ), fds, sizeof( fds ) );
+    if ( sendmsg( fd, &msg, MSG_NOSIGNAL ) != sizeof( req ) ) {
+        free( payload );
+        close( fd );
+        return -1;
+    }
+
+    if ( writeBuffer( fd, payload, len, NULL ) == -1 ||
+         recv( fd, &status, sizeof( status ), MSG_WAITALL ) != sizeof( status ) ) {
+        fprintf( stderr, "Lost the connection to the elfrc server at %s.\n", path );
+        status = 255;
+    }
+
+    free( payload );
+    close( fd );
+    return status;
+}
+
+#ifdef __Linux__
+#define WATCHED_EVENTS ( IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF )
+#define DIRECTORY_EVENTS ( IN_MOVE_SELF | IN_DELETE_SELF | IN_DONT_FOLLOW )
+
+struct Client {
+    pid_t pid;
+    int conn;
+};
+
+struct Server {
+    int listener;
+    int inotify;
+    int records[ 2 ];
+    int signals;
+    sigset_t mask;
+    struct CacheEntry **watches;
+    unsigned char *directories;
+    size_t watchCount;
+    struct Client *clients;
+    size_t clientCount, clientCapacity;
+};
+
+/* Tells whether 'a' and 'b' describe the same version of a file. */
+static int sameStatus( const struct stat *a, const struct stat *b )
+{
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec &&
+           a->st_ctim.tv_sec == b->st_ctim.tv_sec && a->st_ctim.tv_nsec == b->st_ctim.tv_nsec;
+}
+
+/* Watches 'path' for 'events' and returns the watch descriptor, or -1
+ * on failure. */
+static int watch( struct Server *server, const char *path, uint32_t events )
+{
+    struct CacheEntry **grown;
+    unsigned char *directories;
+    int wd;
+
+    if ( ( wd = inotify_add_watch( server->inotify, path, events ) ) == -1 )
+        return -1;
+    if ( (size_t)wd >= server->watchCount ) {
+        if ( ( grown = (struct CacheEntry **)realloc( server->watches, ( wd + 1024 ) * sizeof( *grown ) ) ) == NULL )
+            return -1;
+        server->watches = grown;
+        if ( ( directories = (unsigned char *)realloc( server->directories, wd + 1024 ) ) == NULL )
+            return -1;
+        server->directories = directories;
+        memset( grown + server->watchCount, 0, ( wd + 1024 - server->watchCount ) * sizeof( *grown ) );
+        memset( directories + server->watchCount, 0, wd + 1024 - server->watchCount );
+        server->watchCount = wd + 1024;
+    }
+    return wd;
+}
+
+/* Watches the directories leading to 'path'. If one of them is moved
+ * or removed, 'path' may name a different file afterwards, which the
+ * watch on the file itself doesn't tell. */
+static int watchDirectories( struct Server *server, const char *path )
+{
+    char dir[ PATH_MAX ];
+    size_t i;
+    int wd;
+
+    for ( i = 1; path[ i ] != '\0'; ++i ) {
+        if ( path[ i ] != '/' )
+            continue;
+        memcpy( dir, path, i );
+        dir[ i ] = '\0';
+        if ( ( wd = watch( server, dir, DIRECTORY_EVENTS ) ) == -1 )
+            return -1;
+        server->directories[ wd ] = 1;
+    }
+    return 0;
+}
+
+/* Adds what a request found out about a file to the cache. */
+static void cacheInsert( struct Server *server, const struct CacheRecord *rec )
+{
+    struct CacheEntry *e;
+    struct stat sb;
+    size_t len = strlen( rec->path );
+    unsigned int bucket;
+    int wd;
+
+    if ( ( e = cacheFind( rec->path ) ) != 0 ) {
+        if ( rec->hashed && !e->hashed && sameStatus( &e->sb, &rec->sb ) ) {
+            e->hash = rec->hash;
+            e->hashed = 1;
+        }
+        return;
+    }
+
+    /* Watch first and compare afterwards, so that no change
+     * since the request looked at the file goes unnoticed. */
+    if ( watchDirectories( server, rec->path ) == -1 ||
+         ( wd = watch( server, rec->path, WATCHED_EVENTS ) ) == -1 ||
+         stat( rec->path, &sb ) == -1 || !sameStatus( &sb, &rec->sb ) )
+        return;
+
+    if ( ( e = (struct CacheEntry *)malloc( sizeof( *e ) + len + 1 ) ) == NULL )
+        return;
+    e->path = (char *)( e + 1 );
+    memcpy( e->path, rec->path, len + 1 );
+    e->sb = rec->sb;
+    e->hash = rec->hash;
+    e->hashed = rec->hashed;
+
+    bucket = cacheBucket( e->path );
+    e->next = cache[ bucket ];
+    cache[ bucket ] = e;
+    e->nextWatched = server->watches[ wd ];
+    server->watches[ wd ] = e;
+
+    if ( verbosity > 0 )
+        printf( "Caching %s\n", e->path );
+}
+
+/* Drops every path leading to the file watched as 'wd'. */
+static void cacheForget( struct Server *server, int wd )
+{
+    struct CacheEntry *e, **link;
+
+    if ( wd < 0 || (size_t)wd >= server->watchCount )
+        return;
+
+    while ( ( e = server->watches[ wd ] ) != 0 ) {
+        server->watches[ wd ] = e->nextWatched;
+        for ( link = &cache[ cacheBucket( e->path ) ]; *link != e; link = &( *link )->next )
+            ;
+        *link = e->next;
+        if ( verbosity > 0 )
+            printf( "Forgetting %s\n", e->path );
+        free( e );
+    }
+    inotify_rm_watch( server->inotify, wd );
+}
+
+/* Drops the whole cache, for when it's not known which paths are
+ * affected by a change. */
+static void cacheFlush( struct Server *server )
+{
+    size_t wd;
+
+    if ( verbosity > 0 )
+        printf( "Forgetting all files\n" );
+    for ( wd = 0; wd < server->watchCount; ++wd ) {
+        if ( server->watches[ wd ] ) {
+            cacheForget( server, wd );
+        } else if ( server->directories[ wd ] ) {
+            inotify_rm_watch( server->inotify, wd );
+            server->directories[ wd ] = 0;
+        }
+    }
+}
+
+static void readRecords( struct Server *server )
+{
+    struct CacheRecord rec;
+    ssize_t n;
+
+    while ( ( n = recv( server->records[ 0 ], &rec, sizeof( rec ) - 1, MSG_DONTWAIT ) ) != -1 ) {
+        if ( n <= (ssize_t)offsetof( struct CacheRecord, path ) )
+            continue;
+        rec.path[ n - offsetof( struct CacheRecord, path ) ] = '\0';
+        cacheInsert( server, &rec );
+    }
+}
+
+static void readEvents( struct Server *server )
+{
+    char buffer[ 4096 ] __attribute__(( aligned( __alignof__( struct inotify_event ) ) ));
+    const struct inotify_event *ev;
+    ssize_t n;
+    char *p;
+
+    while ( ( n = read( server->inotify, buffer, sizeof( buffer ) ) ) > 0 ) {
+        for ( p = buffer; p < buffer + n; p += sizeof( *ev ) + ev->len ) {
+            ev = (const struct inotify_event *)p;
+            /* Events got lost if the queue overflowed, and a directory
+             * being moved affects every path below it; both are rare
+             * enough to simply start over. */
+            if ( ev->mask & IN_Q_OVERFLOW )
+                cacheFlush( server );
+            else if ( ev->mask & IN_IGNORED )
+                continue;
+            else if ( ev->wd >= 0 && (size_t)ev->wd < server->watchCount && server->directories[ ev->wd ] )
+                cacheFlush( server );
+            else
+                cacheForget( server, ev->wd );
+        }
+    }
+}
+
+/* Forks the process serving the connection 'conn'. */
+static void acceptRequest( struct Server *server, int conn )
+{
+    struct Client *grown;
+    size_t i;
+    pid_t pid;
+
+    if ( server->clientCount == server->clientCapacity ) {
+        server->clientCapacity = server->clientCapacity ? server->clientCapacity * 2 : 16;
+        if ( ( grown = (struct Client *)realloc( server->clients,
+                                                 server->clientCapacity * sizeof( *grown ) ) ) == NULL ) {
+            fprintf( stderr, "Failed to allocate memory: %s\n", strerror( errno ) );
+            close( conn );
+            return;
+        }
+        server->clients = grown;
+    }
+
+    /* Whatever changed before the client connected must not be
+     * served from the cache. */
+    readEvents( server );
+    readRecords( server );
+
+    fflush( 0 );
+    if ( ( pid = fork() ) == -1 ) {
+        fprintf( stderr, "Failed to fork: %s\n", strerror( errno ) );
+        close( conn );
+        return;
+    }
+
+    if ( pid == 0 ) {
+        close( server->listener );
+        close( server->inotify );
+        close( server->records[ 0 ] );
+        close( server->signals );
+        for ( i = 0; i < server->clientCount; ++i )
+            if ( server->clients[ i ].conn != -1 )
+                close( server->clients[ i ].conn );
+        cacheSocket = server->records[ 1 ];
+        verbosity = 0;
+        sigprocmask( SIG_UNBLOCK, &server->mask, 0 );
+        exit( runRequest( conn ) );
+    }
+
+    server->clients[ server->clientCount ].pid = pid;
+    server->clients[ server->clientCount++ ].conn = conn;
+}
+
+/* Passes the exit status of finished requests on to their clients. */
+static void reapRequests( struct Server *server )
+{
+    struct Client *client;
+    int status, code;
+    pid_t pid;
+
+    while ( ( pid = waitpid( -1, &status, WNOHANG ) ) > 0 ) {
+        for ( client = server->clients; client < server->clients + server->clientCount; ++client )
+            if ( client->pid == pid )
+                break;
+        if ( client == server->clients + server->clientCount )
+            continue;
+
+        if ( client->conn != -1 ) {
+            code = WIFEXITED( status ) ? WEXITSTATUS( status ) : 128 + WTERMSIG( status );
+            send( client->conn, &code, sizeof( code ), MSG_NOSIGNAL );
+            close( client->conn );
+        }
+        *client = server->clients[ --server->clientCount ];
+    }
+}
+
+/* Serves requests of elfrc clients connecting to the Unix socket
+ * 'path' until terminated with SIGINT or SIGTERM. */
+static int serve( const char *path )
+{
+    struct Server server;
+    struct sockaddr_un addr;
+    struct signalfd_siginfo si;
+    struct pollfd *pfd = 0, *grown;
+    size_t pfdCapacity = 0, nfds, i;
+    int conn, fd, result = 0;
 
-    if ( ( fd = open( fn, O_WRONLY | O_CREAT | O_TRUNC, 0644) ) == -1 ) {
-        fprintf( stderr, "Failed to open %s for writing: %s\n", fn, strerror( errno ) );
+    if ( strlen( path ) >= sizeof( addr.sun_path ) ) {
+        fprintf( stderr, "Socket path %s is too long.\n", path );
         return -1;
     }
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sun_family = AF_UNIX;
+    strcpy( addr.sun_path, path );
 
-#define WRITEBLOCK( b ) \
-    if ( write( fd, &b, sizeof( b ) ) == -1 ) { \
-        close( fd ); \
-        return -1; \
+    /* Replace a socket left behind by a server which didn't exit
+     * cleanly, but not one which is still in use. */
+    if ( ( fd = socket( AF_UNIX, SOCK_STREAM, 0 ) ) == -1 ) {
+        fprintf( stderr, "Failed to create socket: %s\n", strerror( errno ) );
+        return -1;
     }
-
-    WRITEBLOCK( hdr )
-
-    WRITEBLOCK( nullHeader )
-    WRITEBLOCK( textHeader )
-    WRITEBLOCK( dataHeader )
-    WRITEBLOCK( bssHeader )
-    WRITEBLOCK( rodataHeader )
-    WRITEBLOCK( commentHeader )
-    WRITEBLOCK( shstrtabHeader )
-    WRITEBLOCK( symtabHeader )
-    WRITEBLOCK( strtabHeader )
-
-    WRITEBLOCK( commentData )
-    WRITEBLOCK( shstrtabData )
-
-    WRITEBLOCK( symtabData )
-    if ( writeSymbols( fd ) == -1 ) {
+    if ( connect( fd, (struct sockaddr *)&addr, sizeof( addr ) ) == 0 ) {
+        fprintf( stderr, "Another elfrc server is listening on %s already.\n", path );
         close( fd );
         return -1;
     }
+    close( fd );
+    if ( errno == ECONNREFUSED )
+        unlink( path );
 
-    if ( writeStringTable( fd ) == -1 ) {
-        close( fd );
+    memset( &server, 0, sizeof( server ) );
+    if ( ( server.listener = socket( AF_UNIX, SOCK_STREAM, 0 ) ) == -1 ||
+         bind( server.listener, (struct sockaddr *)&addr, sizeof( addr ) ) == -1 ||
+         listen( server.listener, SOMAXCONN ) == -1 ) {
+        fprintf( stderr, "Failed to listen on %s: %s\n", path, strerror( errno ) );
         return -1;
     }
-
-    if ( writeFiles( fd ) == -1 ) {
-        close( fd );
+    if ( ( server.inotify = inotify_init1( IN_NONBLOCK ) ) == -1 ||
+         socketpair( AF_UNIX, SOCK_DGRAM, 0, server.records ) == -1 ) {
+        fprintf( stderr, "Failed to set up the cache: %s\n", strerror( errno ) );
+        unlink( path );
         return -1;
     }
 
-#undef WRITEBLOCK
-
-    if ( close( fd ) == -1 ) {
-        fprintf( stderr, "Failed to close file %s: %s\n", fn, strerror( errno ) );
+    sigemptyset( &server.mask );
+    sigaddset( &server.mask, SIGCHLD );
+    sigaddset( &server.mask, SIGINT );
+    sigaddset( &server.mask, SIGTERM );
+    sigprocmask( SIG_BLOCK, &server.mask, 0 );
+    if ( ( server.signals = signalfd( -1, &server.mask, SFD_NONBLOCK ) ) == -1 ) {
+        fprintf( stderr, "Failed to set up signal handling: %s\n", strerror( errno ) );
+        unlink( path );
         return -1;
     }
 
-    return 0;
-}
+    if ( verbosity > 0 )
+        printf( "Listening on %s\n", path );
 
-static void registerResource( int type,
-                              const char *symbol,
-                              const char *fn,
-                              unsigned int filesize )
-{
-    struct Resource *it = 0;
-    struct Resource *res = (struct Resource *)malloc( sizeof( struct Resource ) );
-    res->type = type;
-    res->symbol = strdup( symbol );
-    res->symbolSize = strlen( res->symbol ) + 1;
-    res->filename = strdup( fn );
-    res->size = filesize;
-    if ( type == TEXT )
-        ++res->size;
-    res->next = 0;
+    for ( ;; ) {
+        nfds = 4 + server.clientCount;
+        if ( nfds > pfdCapacity ) {
+            if ( ( grown = (struct pollfd *)realloc( pfd, nfds * 2 * sizeof( *pfd ) ) ) == NULL ) {
+                fprintf( stderr, "Failed to allocate memory: %s\n", strerror( errno ) );
+                result = -1;
+                break;
+            }
+            pfd = grown;
+            pfdCapacity = nfds * 2;
+        }
+        pfd[ 0 ].fd = server.listener;
+        pfd[ 1 ].fd = server.inotify;
+        pfd[ 2 ].fd = server.records[ 0 ];
+        pfd[ 3 ].fd = server.signals;
+        for ( i = 0; i < 4; ++i )
+            pfd[ i ].events = POLLIN;
+        /* A client going away cancels its request. */
+        for ( i = 0; i < server.clientCount; ++i ) {
+            pfd[ 4 + i ].fd = server.clients[ i ].conn;
+            pfd[ 4 + i ].events = POLLRDHUP;
+        }
 
-    if ( !resources ) {
-        resources = res;
-    } else {
-        for ( it = resources; it->next != 0; it = it->next )
-            ;
-        it->next = res;
+        if ( poll( pfd, nfds, -1 ) == -1 ) {
+            if ( errno == EINTR )
+                continue;
+            fprintf( stderr, "Failed to wait for requests: %s\n", strerror( errno ) );
+            result = -1;
+            break;
+        }
+
+        for ( i = 0; i < server.clientCount; ++i ) {
+            if ( pfd[ 4 + i ].revents ) {
+                kill( server.clients[ i ].pid, SIGTERM );
+                close( server.clients[ i ].conn );
+                server.clients[ i ].conn = -1;
+            }
+        }
+        if ( pfd[ 1 ].revents )
+            readEvents( &server );
+        if ( pfd[ 2 ].revents )
+            readRecords( &server );
+        if ( pfd[ 3 ].revents ) {
+            while ( read( server.signals, &si, sizeof( si ) ) == sizeof( si ) )
+                if ( si.ssi_signo != SIGCHLD )
+                    goto done;
+            reapRequests( &server );
+        }
+        if ( pfd[ 0 ].revents && ( conn = accept( server.listener, 0, 0 ) ) != -1 )
+            acceptRequest( &server, conn );
     }
 
-    if ( verbosity > 0 )
-        printf( "Registered resurce %s (type %d) => %s (%d bytes)\n",
-                symbol, type, fn, filesize );
+done:
+    unlink( path );
+    free( pfd );
+    return result;
 }
-
-static void freeResourceList()
+#else
+static int serve( const char *path )
 {
-    struct Resource *it = resources, *next;
+    fprintf( stderr, "--server needs inotify, which this system doesn't have.\n" );
+    return -1;
+}
+#endif
 
-    while ( it != 0 ) {
-        free( it->symbol );
-        free( it->filename );
-        next = it->next;
-        free( it );
-        it = next;
-    }
+static void usage()
+{
+    printf( "elfrc " ELFRC_VERSION " - a resource compiler for ELF systems\n" );
+    printf( ELFRC_COPYRIGHT "\n" );
+    printf( "usage: elfrc [-o <filename>] [-h <filename>] [-H <filename>] [-j <jobs>]\n"
+            "             [-m <target>] [-M <filename>] [-d] [--max-object-size <size>]\n"
+            "             [--section-per-resource] [--large-data] [--shared]\n"
+            "             [--pack <filename>] [--line-index] [--content-hash]\n"
+            "             [--io-uring]\n"
+            "             [--lookup-table <symbol> [--lookup-key <key>]]\n"
+            "             [--stats <filename>] [-v] [resfile]\n"
+            "       elfrc --batch <manifest> [-j <jobs>] [options]\n"
+            "       elfrc --server <socket> [-v]\n" );
 }
 
-static int parseResourceFileData( const char *buffer, size_t len )
+static void listTargets()
 {
-    static enum { ReadType, ReadSymbol, ReadFilename } state = ReadType;
-    static char curType[ 32 ];
-    static unsigned int curTypeLen = 0;
-    static char curSymbol[ 256 ];
-    static unsigned int curSymbolLen = 0;
-    static char curFilename[ PATH_MAX ];
-    static unsigned int curFilenameLen = 0;
-    static unsigned int lineno;
-    struct stat sb;
-    const char *it;
-    int type = 0;
+    unsigned int i;
 
-    /* Signals 'EOF' */
-    if ( !buffer ) {
-        switch ( state ) {
-        case ReadType:
-            fprintf( stderr, "Error: Unexpected end of resource file; expected symbol name.\n" );
-            return -1;
-        case ReadSymbol:
-            fprintf( stderr, "Error: Unexpected end of resource file; expected file name.\n" );
-            return -1;
-        case ReadFilename:
-            curFilename[ curFilenameLen ] = '\0';
+    printf( "Supported targets:" );
+    for ( i = 0; i < sizeof( targets ) / sizeof( targets[0] ); ++i )
+        printf( " %s", targets[ i ].name );
+    printf( "\n" );
+}
 
-            if ( stat( curFilename, &sb ) == -1 ) {
-                    fprintf( stderr, "Error in line %d of resource file: failed to access %s: %s\n",
-                                    lineno, curFilename, strerror( errno ) );
-                    return -1;
-            }
+/* The resource file to compile and the outputs to write. */
+struct Job {
+    const char *resourceFile;
+    char *objectOutput;
+    char *headerOutput;
+    char *cxxHeaderOutput;
+    char *dependencyOutput;
+};
 
-            if ( strcmp( curType, "text") == 0 )
-                    type = TEXT;
-            else if ( strcmp( curType, "binary" ) == 0 )
-                    type = BINARY;
-            registerResource( type, curSymbol, curFilename, sb.st_size );
-            return 0;
-        }
-    }
+/* Compiles the resources of one resource file into the outputs of 'job'. */
+static int runJob( const struct Job *job )
+{
+    unsigned int nshards = 0;
+    struct PhaseMark mark;
 
-    for ( it = buffer; it < buffer + len; ++it ) {
-        switch ( state ) {
-        case ReadType:
-            if ( *it == '\t' ) {
-                curType[ curTypeLen ] = '\0';
-                if ( strcmp( curType, "text" ) != 0 &&
-                     strcmp( curType, "binary" ) != 0 ) {
-                    fprintf( stderr,
-                             "Warning: Unknown resource type '%s' in line %d of resource file; assuming 'binary'.\n",
-                             curType, lineno  );
-                    strncpy( curType, "binary", sizeof( curType ) );
-                }
-                state = ReadSymbol;
-                curSymbolLen = 0;
-            } else if ( *it == '\n' ) {
-                fprintf( stderr,
-                        "Error in line %d of resource file: expected tab and symbol name, got newline\n",
-                        lineno );
-                return -1;
-            } else if ( curTypeLen < sizeof( curType ) ) {
-                curType[ curTypeLen++ ] = *it;
-            } else {
-                    curType[ curTypeLen - 1 ] = '\0';
-                fprintf( stderr,
-                        "Error in line %d of resource file: resource type '%s' is too long\n",
-                        lineno, curType );
-                return -1;
-            }
-            break;
-        case ReadSymbol:
-            if ( *it == '\t' ) {
-                curSymbol[ curSymbolLen ] = '\0';
-                state = ReadFilename;
-                curFilenameLen = 0;
-            } else if ( *it == '\n' ) {
-                fprintf( stderr,
-                        "Error in line %d of resource file: expected tab and filename, got newline\n",
-                        lineno );
-                return -1;
-            } else if ( curSymbolLen < sizeof( curSymbol ) ) {
-                curSymbol[ curSymbolLen++ ] = *it;
-            } else {
-                curSymbol[ curSymbolLen - 1 ] = '\0';
-                fprintf( stderr,
-                        "Error in line %d of resource file: symbol '%s' is too long\n",
-                        lineno, curSymbol );
-                return -1;
-            }
-            break;
-        case ReadFilename:
-            if ( *it == '\n' ) {
-                curFilename[ curFilenameLen ] = '\0';
-
-                if ( stat( curFilename, &sb ) == -1 ) {
-                    fprintf( stderr, "Error in line %d of resource file: failed to access %s: %s\n",
-                             lineno, curFilename, strerror( errno ) );
-                    return -1;
-                }
+    if ( maxObjectSize > 0 && ( !job->objectOutput || !validObjectPattern( job->objectOutput ) ) ) {
+        fprintf( stderr, "--max-object-size needs an object file name with exactly one %%d in it.\n" );
+        return -1;
+    }
 
-                if ( strcmp( curType, "text") == 0 )
-                    type = TEXT;
-                else if ( strcmp( curType, "binary" ) == 0 )
-                    type = BINARY;
-                registerResource( type, curSymbol, curFilename, sb.st_size );
-
-                state = ReadType;
-                curTypeLen = 0;
-                ++lineno;
-            } else if ( curFilenameLen < sizeof( curFilename ) ) {
-                curFilename[ curFilenameLen++ ] = *it;
-            } else {
-                curFilename[ curFilenameLen - 1 ] = '\0';
-                fprintf( stderr,
-                        "Error in line %d of resource file: file name '%s' is too long\n",
-                        lineno, curFilename );
-                return -1;
-            }
-            break;
-        }
+    if ( sharedObject && !job->objectOutput ) {
+        fprintf( stderr, "--shared needs the name of the shared object given with -o.\n" );
+        return -1;
     }
 
-    return 0;
-}
+    /* Also removes the spill files of streams when bailing out. */
+    atexit( freeResourceList );
 
-static int loadResources( const char *fn )
-{
-    int fd;
-    char buffer[ 1024 ];
-    ssize_t nread;
+    if ( statsOutput )
+        ioStatsFd = open( "/proc/self/io", O_RDONLY );
 
-    if ( verbosity > 0 )
-        printf( "Loading resource configuration from %s\n", fn );
+    markPhase( &mark );
+    if ( loadResources( job->resourceFile ) == -1 )
+        return -1;
+    endPhase( &mark, "load" );
 
-    if ( !fn || strcmp( fn, "-" ) == 0 ) {
-        fd = STDIN_FILENO;
-    } else if ( ( fd = open( fn, O_RDONLY ) ) == -1 ) {
-        fprintf( stderr, "Failed to open %s for reading: %s\n", fn, strerror( errno ) );
+    markPhase( &mark );
+    if ( lineIndex && ( checkAccessorNames( LINEINDEX ) == -1 || addLineIndexes() == -1 ) )
         return -1;
-    }
+    endPhase( &mark, "lines" );
 
-    do {
-        if ( ( nread = read( fd, buffer, sizeof( buffer ) ) ) == -1 ) {
-            fprintf( stderr, "Failed to read from %s: %s\n", fn, strerror( errno ) );
-            close( fd );
-            return -1;
-        }
+    markPhase( &mark );
+    if ( contentHash && ( checkAccessorNames( CONTENTHASH ) == -1 || addContentHashes() == -1 ) )
+        return -1;
+    endPhase( &mark, "hash" );
 
-        if ( parseResourceFileData( buffer, nread ) == -1 ) {
-            close( fd );
-            return -1;
-        }
-    } while ( nread == sizeof( buffer ) );
+    markPhase( &mark );
+    if ( deduplicate && deduplicateResources() == -1 )
+        return -1;
+    endPhase( &mark, "deduplicate" );
 
-    parseResourceFileData( 0, 0 );
+    markPhase( &mark );
+    if ( checkAccessorNames( ZSTD ) == -1 || compressResources() == -1 )
+        return -1;
+    endPhase( &mark, "compress" );
 
-    return close( fd );
-}
+    if ( lookupTable && addLookupTable() == -1 )
+        return -1;
 
-static int writeCHeader( const char *fn )
-{
-    FILE *fd;
-    struct Resource *it;
-    char includeGuard[ 19 ];
-    int i;
+    /* With several object files, each one is laid out right before
+     * it's written; that time counts as 'write'. */
+    if ( maxObjectSize > 0 ) {
+        markPhase( &mark );
+        if ( ( nshards = assignShards() ) == 0 )
+            return -1;
+        endPhase( &mark, "layout" );
+        markPhase( &mark );
+        if ( writeShardedRelocatables( job->objectOutput, nshards ) == -1 )
+            return -1;
+        endPhase( &mark, "write" );
+    } else {
+        markPhase( &mark );
+        if ( patchHeaders() == -1 )
+            return -1;
 
-    if ( !fn )
-        return 0;
+        if ( lookupTable && fillLookupTable( lastResource ) == -1 )
+            return -1;
+        endPhase( &mark, "layout" );
 
-    if ( verbosity > 0 )
-        printf( "Writing header file %s\n", fn );
+        markPhase( &mark );
+        if ( sharedObject ? writeSharedObject( job->objectOutput ) == -1
+                          : writeELFRelocatable( job->objectOutput ) == -1 )
+            return -1;
+        endPhase( &mark, "write" );
 
-    if ( ( fd = fopen( fn, "w+" ) ) == NULL ) {
-        fprintf( stderr, "Failed to open %s for writing: %s\n",
-                 fn, strerror( errno ) );
-        return -1;
+        markPhase( &mark );
+        if ( writePack( packOutput ) == -1 )
+            return -1;
+        endPhase( &mark, "pack" );
     }
 
-    /* Create a fancy include guard like 'H_2349823487234' */
-    srand( time( NULL ) );
-    includeGuard[0] = 'H';
-    includeGuard[1] = '_';
-    for ( i = 2; i < sizeof( includeGuard ) ; ++i )
-        includeGuard[i] = '0' + rand() % 10;
-    includeGuard[18] = '\0';
+    markPhase( &mark );
+    if ( writeCXXHeader( job->cxxHeaderOutput ) == -1 )
+        return -1;
 
-    /* Write include guard and C++ fixup out. */
-    fprintf( fd,
-             "#ifndef %s\n"
-             "#define %s\n"
-             "\n"
-             "#ifdef __cplusplus\n"
-             "extern \"C\" {\n"
-             "#endif\n"
-             "\n", includeGuard, includeGuard );
+    if ( writeCHeader( job->headerOutput, job->objectOutput ) == -1 )
+        return -1;
+    endPhase( &mark, "header" );
 
-    fprintf( fd,
-            "/* Automatically generated by elfrc " ELFRC_VERSION ". "
-            "Do not modify by hand. */\n" );
+    markPhase( &mark );
+    if ( writeDependencyFile( job->dependencyOutput,
+                              job->objectOutput ? job->objectOutput :
+                              job->headerOutput ? job->headerOutput :
+                              job->cxxHeaderOutput ? job->cxxHeaderOutput : packOutput,
+                              nshards, job->resourceFile ) == -1 )
+        return -1;
+    endPhase( &mark, "depfile" );
 
-    for ( it = resources; it != 0; it = it->next )
-        fprintf( fd,
-                 "\n"
-                 "/* %s */\n"
-                 "extern const char %s[%d];\n",
-                 it->filename, it->symbol, it->size );
+    if ( writeStats( statsOutput, job->objectOutput ? ( nshards ? nshards : 1 ) : 0 ) == -1 )
+        return -1;
 
-    /* Write include guard and C++ fixup out. */
-    fprintf( fd,
-             "\n"
-             "#ifdef __cplusplus\n"
-             "} /* extern \"C\" */\n"
-             "#endif\n"
-             "\n"
-             "#endif /* %s */\n", includeGuard );
+    freeResourceList();
 
-    return fclose( fd );
+    return 0;
 }
 
-static void usage()
+/* Reads the manifest of --batch, each line of which describes a job:
+ * the resource file followed by the object file, C header, C++ header
+ * and dependency file to write, separated by tabs. Trailing fields
+ * may be left out, and empty fields or "-" stand for no such output. */
+static struct Job *readManifest( const char *fn, char **buffer, unsigned int *count )
 {
-    printf( "elfrc " ELFRC_VERSION " - a resource compiler for ELF systems\n" );
-    printf( ELFRC_COPYRIGHT "\n" );
-    printf( "usage: elfrc [-o <filename>] [-h <filename>] [-v] [resfile]\n" );
+    struct Job *list = 0, *grown;
+    char *fields[ 6 ];
+    char *line, *next, *end;
+    size_t len, capacity = 0;
+    unsigned int lineno, i, n;
+    int fd;
+
+    *count = 0;
+    if ( ( fd = open( fn, O_RDONLY ) ) == -1 ) {
+        fprintf( stderr, "Failed to open %s for reading: %s\n", fn, strerror( errno ) );
+        return 0;
+    }
+    *buffer = readAll( fd, &len );
+    close( fd );
+    if ( !*buffer || ( line = (char *)realloc( *buffer, len + 1 ) ) == NULL ) {
+        fprintf( stderr, "Failed to read from %s: %s\n", fn, strerror( errno ) );
+        free( *buffer );
+        return 0;
+    }
+    *buffer = line;
+    line[ len ] = '\0';
+
+    for ( lineno = 1; *line; line = next, ++lineno ) {
+        if ( ( end = strchr( line, '\n' ) ) != NULL ) {
+            *end = '\0';
+            next = end + 1;
+        } else {
+            next = line + strlen( line );
+        }
+        if ( !*line )
+            continue;
+
+        if ( *count == capacity ) {
+            capacity = capacity ? capacity * 2 : 64;
+            if ( ( grown = (struct Job *)realloc( list, capacity * sizeof( *list ) ) ) == NULL ) {
+                fprintf( stderr, "Failed to allocate memory: %s\n", strerror( errno ) );
+                free( list );
+                return 0;
+            }
+            list = grown;
+        }
+
+        for ( n = 0; n < 6; ++n ) {
+            fields[ n ] = line;
+            if ( ( end = strchr( line, '\t' ) ) == NULL )
+                break;
+            *end = '\0';
+            line = end + 1;
+        }
+        if ( n >= 5 ) {
+            fprintf( stderr, "Error in line %u of %s: too many fields\n", lineno, fn );
+            free( list );
+            return 0;
+        }
+        for ( i = 1; i <= n; ++i )
+            if ( !*fields[ i ] || strcmp( fields[ i ], "-" ) == 0 )
+                fields[ i ] = 0;
+        for ( ; i < 5; ++i )
+            fields[ i ] = 0;
+
+        list[ *count ].resourceFile = fields[ 0 ];
+        list[ *count ].objectOutput = fields[ 1 ];
+        list[ *count ].headerOutput = fields[ 2 ];
+        list[ *count ].cxxHeaderOutput = fields[ 3 ];
+        list[ *count ].dependencyOutput = fields[ 4 ];
+        if ( !list[ *count ].objectOutput && !list[ *count ].headerOutput &&
+             !list[ *count ].cxxHeaderOutput ) {
+            fprintf( stderr, "Error in line %u of %s: no output given\n", lineno, fn );
+            free( list );
+            return 0;
+        }
+        ++*count;
+    }
+
+    return list;
 }
 
-static const char *findPathToSelf( const char *invocation )
+/* A process running one job of a batch. */
+struct BatchSlot {
+    pid_t pid;
+    unsigned int job;
+};
+
+/* Runs all jobs listed in the manifest 'fn', 'jobs' of them at a time.
+ * Each one runs in a process of its own, so that it starts out with
+ * all the state (resources, section headers, ...) fresh; after a job
+ * failed, no more are started. */
+static int runBatch( const char *fn )
 {
-    static char self[ PATH_MAX ];
-    char *path, *it;
-    struct stat sb;
+    struct Job *list;
+    struct BatchSlot *running;
+    char *buffer;
+    unsigned int count, next = 0, active = 0, i, failed = 0;
+    int parallel = jobs, status;
+    pid_t pid;
+
+    if ( ( list = readManifest( fn, &buffer, &count ) ) == NULL )
+        return -1;
+    if ( ( running = (struct BatchSlot *)calloc( parallel, sizeof( *running ) ) ) == NULL ) {
+        fprintf( stderr, "Failed to allocate memory: %s\n", strerror( errno ) );
+        free( list );
+        free( buffer );
+        return -1;
+    }
 
-    /* Invoked with absolute path, just use that. */
-    if ( invocation[0] == '/' ) {
-        strncpy( self, invocation, sizeof( self ) );
-        return self;
-
-    /* Invoked with relative path, append that to current working dir. */
-    } else if ( strchr( invocation, '/' ) != NULL ) {
-        getcwd( self, sizeof( self ) );
-        strncat( self, "/", sizeof( self ) - strlen( self ) - 1 );
-        strncat( self, invocation, sizeof( self ) - strlen( self ) - 1 );
-        return self;
-
-    /* Invoked with no path at all, scan through PATH to find us. */
-    } else if ( ( path = getenv( "PATH" ) ) != NULL ) {
-        for ( it = strtok( path, ":" ); it != NULL; it = strtok( NULL, ":" ) ) {
-            snprintf( self, sizeof( self ), "%s/%s", it, invocation );
-            if ( stat( self, &sb ) == -1 ) {
+    while ( active > 0 || ( next < count && !failed ) ) {
+        if ( next < count && !failed && active < (unsigned int)parallel ) {
+            if ( verbosity > 0 )
+                printf( "Starting job %u of %u: %s\n", next + 1, count, list[ next ].resourceFile );
+            fflush( 0 );
+            if ( ( pid = fork() ) == -1 ) {
+                fprintf( stderr, "Failed to fork: %s\n", strerror( errno ) );
+                failed = 1;
                 continue;
             }
-
-            if ( S_ISREG( sb.st_mode ) ) {
-                return self;
+            if ( pid == 0 ) {
+                jobs = 1;
+                exit( runJob( &list[ next ] ) );
             }
+            for ( i = 0; running[ i ].pid != 0; ++i )
+                ;
+            running[ i ].pid = pid;
+            running[ i ].job = next;
+            ++active;
+            ++next;
+            continue;
+        }
+
+        if ( ( pid = wait( &status ) ) == -1 ) {
+            if ( errno == EINTR )
+                continue;
+            break;
+        }
+        for ( i = 0; i < (unsigned int)parallel && running[ i ].pid != pid; ++i )
+            ;
+        if ( i == (unsigned int)parallel )
+            continue;
+        running[ i ].pid = 0;
+        --active;
+        if ( !WIFEXITED( status ) || WEXITSTATUS( status ) != 0 ) {
+            fprintf( stderr, "Job %u of %s (%s) failed.\n", running[ i ].job + 1, fn,
+                     list[ running[ i ].job ].resourceFile );
+            failed = 1;
         }
     }
 
-    return 0;
+    free( running );
+    free( list );
+    free( buffer );
+    return failed ? -1 : 0;
 }
 
-int main( int argc, char **argv )
+static int compile( int argc, char **argv )
 {
-    const char *invocation = argv[0];
-    const char *pathToSelf = 0;
-    char *objectOutput = 0;
-    char *headerOutput = 0;
-    signed char ch = 0;
+    const char *targetName = 0;
+    struct Job job = { 0, 0, 0, 0, 0 };
+    int ch = 0;
+    static const struct option longOptions[] = {
+        { "max-object-size", required_argument, 0, 'S' },
+        { "section-per-resource", no_argument, 0, 'P' },
+        { "large-data", no_argument, 0, 'L' },
+        { "lookup-table", required_argument, 0, 'T' },
+        { "lookup-key", required_argument, 0, 'K' },
+        { "stats", required_argument, 0, 'R' },
+        { "batch", required_argument, 0, 'B' },
+        { "shared", no_argument, 0, 'Y' },
+        { "pack", required_argument, 0, 'A' },
+        { "line-index", no_argument, 0, 'I' },
+        { "content-hash", no_argument, 0, 'X' },
+        { "io-uring", no_argument, 0, 'U' },
+        { 0, 0, 0, 0 }
+    };
 
-    while ( ( ch = getopt( argc, argv, "o:h:v?" ) ) != -1 ) {
+    while ( ( ch = getopt_long( argc, argv, "o:h:H:j:m:M:dv?", longOptions, 0 ) ) != -1 ) {
         switch( ch ) {
         case 'o':
-            objectOutput = optarg;
+            job.objectOutput = optarg;
             break;
         case 'h':
-            headerOutput = optarg;
+            job.headerOutput = optarg;
+            break;
+        case 'H':
+            job.cxxHeaderOutput = optarg;
+            break;
+        case 'j':
+            if ( ( jobs = atoi( optarg ) ) < 1 ) {
+                fprintf( stderr, "Invalid number of jobs '%s'.\n", optarg );
+                return -1;
+            }
+            break;
+        case 'm':
+            if ( strcmp( optarg, "list" ) == 0 ) {
+                listTargets();
+                return 0;
+            }
+            targetName = optarg;
+            break;
+        case 'M':
+            job.dependencyOutput = optarg;
+            break;
+        case 'd':
+            deduplicate = 1;
+            break;
+        case 'S':
+            if ( parseSize( optarg, &maxObjectSize ) == -1 || maxObjectSize == 0 ) {
+                fprintf( stderr, "Invalid object size '%s'.\n", optarg );
+                return -1;
+            }
+            break;
+        case 'P':
+            sectionPerResource = 1;
+            break;
+        case 'L':
+            largeData = 1;
+            break;
+        case 'T':
+            lookupTable = optarg;
+            break;
+        case 'R':
+            statsOutput = optarg;
+            break;
+        case 'B':
+            batchManifest = optarg;
+            break;
+        case 'Y':
+            sharedObject = 1;
+            break;
+        case 'A':
+            packOutput = optarg;
+            break;
+        case 'I':
+            lineIndex = 1;
+            break;
+        case 'X':
+            contentHash = 1;
+            break;
+        case 'U':
+            ioUring = 1;
+            break;
+        case 'K':
+            if ( strcmp( optarg, "symbol" ) == 0 ) {
+                lookupKey = KeySymbol;
+            } else if ( strcmp( optarg, "filename" ) == 0 ) {
+                lookupKey = KeyFilename;
+            } else {
+                fprintf( stderr, "Invalid lookup key '%s'; use 'symbol' or 'filename'.\n", optarg );
+                return -1;
+            }
             break;
         case 'v':
             ++verbosity;
@@ -907,32 +6060,93 @@ int main( int argc, char **argv )
     argc -= optind;
     argv += optind;
 
-    if ( !objectOutput && !headerOutput ) {
+    if ( batchManifest ) {
+        if ( job.objectOutput || job.headerOutput || job.cxxHeaderOutput || job.dependencyOutput ||
+             statsOutput || packOutput || argc > 0 ) {
+            fprintf( stderr, "--batch takes the resource file and outputs of each job from the manifest;\n"
+                             "-o, -h, -H, -M, --stats, --pack and a resource file can't be given as well.\n" );
+            return -1;
+        }
+    } else if ( !job.objectOutput && !job.headerOutput && !job.cxxHeaderOutput && !packOutput ) {
         usage();
-        printf( "No output chosen. Try -o and/or -h.\n" );
+        printf( "No output chosen. Try -o, -h, -H and/or --pack.\n" );
+        return -1;
+    }
+
+    if ( packOutput && maxObjectSize > 0 ) {
+        fprintf( stderr, "--pack shares the layout of a single object file; it can't be combined\n"
+                         "with --max-object-size.\n" );
         return -1;
     }
 
-    if ( ( pathToSelf = findPathToSelf( invocation ) ) == NULL ) {
-        printf( "Failed to determine path to myself." );
-        printf( "Try invoking with absolute path." );
+    if ( sharedObject && ( maxObjectSize > 0 || sectionPerResource || largeData || lookupTable ||
+                           job.cxxHeaderOutput ) ) {
+        fprintf( stderr, "--shared can't be combined with --max-object-size, --section-per-resource,\n"
+                         "--large-data, --lookup-table or -H.\n" );
         return -1;
     }
 
-    if ( loadResources( argv[0] ) == -1 )
+    if ( statsOutput && strcmp( statsOutput, "-" ) == 0 && verbosity > 0 ) {
+        fprintf( stderr, "--stats - writes to the standard output, where -v prints its progress;\n"
+                         "give --stats a file name instead.\n" );
         return -1;
+    }
 
-    if ( patchHeaders( pathToSelf ) == -1 )
+    if ( lookupTable && ( maxObjectSize > 0 || sectionPerResource ) ) {
+        fprintf( stderr, "--lookup-table needs all resources in one section; it can't be combined\n"
+                         "with --max-object-size or --section-per-resource.\n" );
         return -1;
+    }
 
-    if ( writeELFRelocatable( objectOutput ) == -1 )
+    if ( targetName ) {
+        if ( !findTarget( targetName ) ) {
+            fprintf( stderr, "Unknown target '%s'.\n", targetName );
+            listTargets();
+            return -1;
+        }
+        selectTarget( findTarget( targetName ), ELFOSABI_NONE );
+    } else {
+#ifdef NATIVE_TARGET
+        selectTarget( findTarget( NATIVE_TARGET ), NATIVE_OSABI );
+#else
+        fprintf( stderr, "Don't know which target this system is; please choose one with -m.\n" );
+        listTargets();
         return -1;
+#endif
+    }
 
-    if ( writeCHeader( headerOutput ) == -1 )
+    if ( largeData && hdr.e_machine != EM_X86_64 ) {
+        fprintf( stderr, "--large-data is only supported for x86-64.\n" );
         return -1;
+    }
 
-    freeResourceList();
+    if ( batchManifest )
+        return runBatch( batchManifest );
 
-    return 0;
+    job.resourceFile = argv[0];
+    return runJob( &job );
 }
 
+int main( int argc, char **argv )
+{
+    const char *server;
+    int i, status;
+
+    if ( argc >= 3 && strcmp( argv[1], "--server" ) == 0 ) {
+        for ( i = 3; i < argc && strcmp( argv[i], "-v" ) == 0; ++i )
+            ++verbosity;
+        if ( i < argc ) {
+            usage();
+            return -1;
+        }
+        return serve( argv[2] );
+    }
+
+    /* Build systems running elfrc over and over again can set this
+     * to have a server do the work. */
+    if ( ( server = getenv( "ELFRC_SERVER" ) ) != NULL && *server &&
+         ( status = forwardRequest( server, argc, argv ) ) != -1 )
+        return status;
+
+    return compile( argc, argv );
+}
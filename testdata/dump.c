@@ -0,0 +1,11 @@
+/* Writes the resources listed in RESOURCES (e.g. -DRESOURCES='X( a ) X( b )')
+ * of the header file HEADER to the standard output, one after the other. */
+#include <stdio.h>
+#include HEADER
+
+int main()
+{
+#define X( symbol ) fwrite( symbol, 1, sizeof( symbol ), stdout );
+    RESOURCES
+    return 0;
+}
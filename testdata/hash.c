@@ -0,0 +1,12 @@
+/* Prints the content hashes of 'a' and 'e' declared in hash.h, failing
+ * if the stored ones differ from the constants in the header. */
+#include <stdio.h>
+#include "hash.h"
+
+int main()
+{
+    if ( a_hash != a_hash_value || e_hash != e_hash_value )
+        return 1;
+    printf( "%016llx\n%016llx\n", (unsigned long long)a_hash, (unsigned long long)e_hash );
+    return 0;
+}
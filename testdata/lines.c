@@ -0,0 +1,12 @@
+/* Prints the line index of the text 't' declared in lines.h. */
+#include <stdio.h>
+#include "lines.h"
+
+int main()
+{
+    unsigned int i;
+
+    for ( i = 0; i <= t_nlines; ++i )
+        printf( "%u\n", (unsigned int)t_lines[ i ] );
+    return 0;
+}
@@ -0,0 +1,26 @@
+/* Maps the pack file given first and writes the resources named by the
+ * other arguments to the standard output. */
+#include <stdio.h>
+#include "pack.h"
+
+int main( int argc, char **argv )
+{
+    struct pack_pak pack;
+    const char *data;
+    size_t size;
+    int i;
+
+    if ( argc < 2 || pack_pak_open( &pack, argv[ 1 ] ) == -1 ) {
+        fprintf( stderr, "Failed to open the pack file.\n" );
+        return 1;
+    }
+    for ( i = 2; i < argc; ++i ) {
+        if ( ( data = pack_pak_find( &pack, argv[ i ], &size ) ) == NULL ) {
+            fprintf( stderr, "No resource %s in the pack file.\n", argv[ i ] );
+            return 1;
+        }
+        fwrite( data, 1, size, stdout );
+    }
+    pack_pak_close( &pack );
+    return 0;
+}
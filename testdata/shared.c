@@ -0,0 +1,15 @@
+/* Writes the resources 'a' and 'b' of the shared object declared in
+ * shared.h to the standard output, through the accessors. */
+#include <stdio.h>
+#include "shared.h"
+
+int main()
+{
+    if ( !a() || !b() ) {
+        fprintf( stderr, "%s\n", dlerror() );
+        return 1;
+    }
+    fwrite( a(), 1, a_size, stdout );
+    fwrite( b(), 1, b_size, stdout );
+    return 0;
+}